@@ -1,42 +1,22 @@
 #include "BSPLoader.h"
 
 #include <SOIL2/SOIL2.h>
+#include <glm/gtc/matrix_transform.hpp>
 
-#include "EntityParser.h"
+#include "BezierKernel.h"
+#include "MD3Kernel.h"
 #include "MD3Loader.h"
+#include "MeshOptimizer.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
-constexpr auto MD3_XYZ_SCALE = (1.0/64);
-const int bezierLevel = 10;
-
-// addition operator for vertices
-vertex operator+(const vertex& v1, const vertex& v2)
-{
-	return vertex{ 
-		v1.position + v2.position,	   
-		v1.dtexcoord + v2.dtexcoord,	   
-		v1.lmtexcoord + v2.lmtexcoord,	   
-		v1.normal + v2.normal
-	};
-}
-
-vertex operator*(const vertex& v1, const float& d)
-{
-	return vertex{ 
-		v1.position * d, 
-		v1.dtexcoord * d, 
-		v1.lmtexcoord * d, 
-		v1.normal * d 
-	};
-}
-
-std::vector<unsigned int> BSPLoader::get_indices()
-{
-	return indices;
-}
-
 void BSPLoader::get_lump_position(int index, int& offset, int& length)
 {
 	offset = file_directory.direntries[index].offset;
@@ -71,6 +51,316 @@ void BSPLoader::build_indices()
 	}
 }
 
+static bool within(float a, float b, float epsilon)
+{
+	return fabsf(a - b) <= epsilon;
+}
+
+static bool vertices_match(const vertex& a, const vertex& b, const weld_settings& settings)
+{
+	if (memcmp(a.colour, b.colour, sizeof(a.colour)) != 0) return false;
+
+	for (int k = 0; k < 3; ++k)
+	{
+		if (!within(a.position[k], b.position[k], settings.position_epsilon)) return false;
+		if (!within(a.normal[k], b.normal[k], settings.normal_epsilon)) return false;
+	}
+
+	for (int k = 0; k < 2; ++k)
+	{
+		if (!within(a.dtexcoord[k], b.dtexcoord[k], settings.texcoord_epsilon)) return false;
+		if (!within(a.lmtexcoord[k], b.lmtexcoord[k], settings.texcoord_epsilon)) return false;
+	}
+
+	return true;
+}
+
+// hash of the cell a vertex position falls in. with a tolerance, duplicates that straddle
+// a cell boundary won't be found, which only costs a missed merge.
+static unsigned long long position_hash(const glm::vec3& position, float epsilon)
+{
+	unsigned long long hash = 14695981039346656037ull;
+
+	for (int k = 0; k < 3; ++k)
+	{
+		unsigned int bits;
+		if (epsilon > 0.f)
+			bits = (unsigned int)(int)floorf(position[k] / epsilon);
+		else
+		{
+			float value = position[k] == 0.f ? 0.f : position[k];	// fold -0 into 0
+			memcpy(&bits, &value, sizeof(bits));
+		}
+
+		hash = (hash ^ bits) * 1099511628211ull;
+	}
+
+	return hash;
+}
+
+void BSPLoader::weld_vertices(bool patches)
+{
+	// group the faces by what they get drawn with, only vertices within a group may merge.
+	// patches are welded on their own so their vertices stay in a region that can be rebuilt.
+	std::map<std::pair<int, int>, std::vector<int>> groups;
+	for (int i = 0; i < file_faces.size(); ++i)
+	{
+		const face& _face = file_faces[i];
+		if (_face.type == FaceTypes::Billboard || _face.n_meshverts == 0) continue;
+		if ((_face.type == FaceTypes::Patch) != patches) continue;
+
+		groups[std::make_pair(_face.texture, _face.lm_index)].push_back(i);
+	}
+
+	std::vector<unsigned int> remap(file_vertices.size());
+	for (unsigned int v = 0; v < remap.size(); ++v)
+		remap[v] = v;
+
+	std::vector<std::pair<unsigned long long, unsigned int>> hashed;
+
+	for (auto& group : groups)
+	{
+		hashed.clear();
+		for (int f : group.second)
+		{
+			const face& _face = file_faces[f];
+			for (int j = 0; j < _face.n_meshverts; ++j)
+			{
+				unsigned int v = indices[_face.meshvert + j];
+				hashed.push_back(std::make_pair(position_hash(file_vertices[v].position, weld_config.position_epsilon), v));
+			}
+		}
+
+		// sorting by hash then index makes the lowest index in each set of duplicates the survivor
+		std::sort(hashed.begin(), hashed.end());
+		hashed.erase(std::unique(hashed.begin(), hashed.end()), hashed.end());
+
+		for (size_t run = 0; run < hashed.size();)
+		{
+			size_t run_end = run + 1;
+			while (run_end < hashed.size() && hashed[run_end].first == hashed[run].first) ++run_end;
+
+			for (size_t a = run; a < run_end; ++a)
+			{
+				unsigned int va = hashed[a].second;
+				if (remap[va] != va) continue;
+
+				for (size_t b = a + 1; b < run_end; ++b)
+				{
+					unsigned int vb = hashed[b].second;
+					if (remap[vb] == vb && vertices_match(file_vertices[va], file_vertices[vb], weld_config))
+						remap[vb] = va;
+				}
+			}
+
+			run = run_end;
+		}
+
+		for (int f : group.second)
+		{
+			const face& _face = file_faces[f];
+			for (int j = 0; j < _face.n_meshverts; ++j)
+			{
+				unsigned int& index = indices[_face.meshvert + j];
+				index = remap[index];
+			}
+		}
+	}
+
+	// drop the vertices that were merged away. a vertex merged in one group can still be used
+	// by a face in another group, so check what the index buffer actually references.
+	std::vector<bool> referenced(file_vertices.size(), false);
+	for (auto index : indices)
+		referenced[index] = true;
+
+	std::vector<unsigned int> compact(file_vertices.size());
+	unsigned int count = 0;
+	for (unsigned int v = 0; v < file_vertices.size(); ++v)
+	{
+		compact[v] = count;
+		if (remap[v] == v || referenced[v])
+			file_vertices[count++] = file_vertices[v];
+	}
+
+	// vertices below the patch region are never merged away, so it still starts where it did
+	weld_stats& stats = patches ? patch_weld : static_weld;
+	int first = patches ? patch_region.first_vertex : 0;
+	stats.groups = (int)groups.size();
+	stats.vertices_before = (int)file_vertices.size() - first;
+	stats.vertices_after = (int)count - first;
+
+	file_vertices.resize(count);
+
+	for (auto& index : indices)
+		index = compact[index];
+
+	// only patches and billboards still read their own vertex range, everything else goes
+	// through the index buffer and its old range is meaningless now
+	for (auto& _face : file_faces)
+	{
+		if (_face.type == FaceTypes::Patch || _face.type == FaceTypes::Billboard)
+			_face.vertex = compact[_face.vertex];
+		else if (!patches)
+		{
+			_face.vertex = 0;
+			_face.n_vertexes = 0;
+		}
+	}
+}
+
+void BSPLoader::optimize_indices(bool patches)
+{
+	size_t triangles = 0;
+	size_t misses_before = 0;
+	size_t misses_after = 0;
+
+	std::vector<unsigned int> local;
+	std::vector<unsigned int> face_vertices;
+	std::vector<glm::vec3> positions;
+
+	// each face is drawn on its own, so each face's index range is optimised as a batch. after
+	// welding a face's vertices can be anywhere in its group, so the batch is numbered by the
+	// distinct vertices the face uses rather than the range between its lowest and highest.
+	for (auto& _face : file_faces)
+	{
+		if (_face.type == FaceTypes::Billboard || _face.n_meshverts < 3) continue;
+		if ((_face.type == FaceTypes::Patch) != patches) continue;
+
+		unsigned int* face_indices = &indices[_face.meshvert];
+		size_t count = _face.n_meshverts;
+
+		face_vertices.assign(face_indices, face_indices + count);
+		std::sort(face_vertices.begin(), face_vertices.end());
+		face_vertices.erase(std::unique(face_vertices.begin(), face_vertices.end()), face_vertices.end());
+		size_t vertex_count = face_vertices.size();
+
+		local.resize(count);
+		for (size_t j = 0; j < count; ++j)
+			local[j] = (unsigned int)(std::lower_bound(face_vertices.begin(), face_vertices.end(), face_indices[j]) - face_vertices.begin());
+
+		positions.resize(vertex_count);
+		for (size_t v = 0; v < vertex_count; ++v)
+			positions[v] = file_vertices[face_vertices[v]].position;
+
+		triangles += count / 3;
+		misses_before += MeshOptimizer::count_cache_misses(&local[0], count, vertex_count);
+
+		MeshOptimizer::optimize_vertex_cache(&local[0], count, vertex_count);
+		MeshOptimizer::optimize_overdraw(&local[0], count, &positions[0].x, vertex_count, sizeof(glm::vec3));
+
+		misses_after += MeshOptimizer::count_cache_misses(&local[0], count, vertex_count);
+
+		for (size_t j = 0; j < count; ++j)
+			face_indices[j] = face_vertices[local[j]];
+	}
+
+	// lay the vertices out in the order the index buffer first uses them. vertices nothing
+	// references (patch control points) keep their relative order at the end of the region.
+	// the patch region only ever references itself, so it is reordered in place.
+	size_t first_vertex = patches ? patch_region.first_vertex : 0;
+	size_t first_index = patches ? patch_region.first_index : 0;
+	size_t vertex_count = file_vertices.size() - first_vertex;
+	size_t index_count = indices.size() - first_index;
+
+	if (index_count > 0)
+	{
+		local.resize(index_count);
+		for (size_t j = 0; j < index_count; ++j)
+			local[j] = indices[first_index + j] - (unsigned int)first_vertex;
+
+		std::vector<unsigned int> remap(vertex_count);
+		MeshOptimizer::optimize_vertex_fetch_remap(&remap[0], &local[0], index_count, vertex_count);
+
+		std::vector<vertex> reordered(vertex_count);
+		for (size_t v = 0; v < vertex_count; ++v)
+			reordered[remap[v]] = file_vertices[first_vertex + v];
+		std::copy(reordered.begin(), reordered.end(), file_vertices.begin() + first_vertex);
+
+		for (size_t j = 0; j < index_count; ++j)
+			indices[first_index + j] = remap[local[j]] + (unsigned int)first_vertex;
+
+		// patch faces point at their control points, which are never in the patch region
+		if (!patches)
+		{
+			for (auto& _face : file_faces)
+			{
+				if (_face.type == FaceTypes::Patch || _face.type == FaceTypes::Billboard)
+					_face.vertex = remap[_face.vertex];
+			}
+		}
+	}
+
+	cache_stats& stats = patches ? patch_cache : static_cache;
+	stats.triangles = (int)triangles;
+	if (triangles > 0)
+	{
+		stats.acmr_before = (float)misses_before / triangles;
+		stats.acmr_after = (float)misses_after / triangles;
+	}
+}
+
+// loads an image under data/, trying .tga then .jpg like q3. 0 if neither is there.
+static GLuint load_texture(const std::string& file, int channels, unsigned int flags)
+{
+	std::string path = "/data/" + file;
+
+	if (PHYSFS_exists((path + ".tga").c_str()))
+		path += ".tga";
+	else if (PHYSFS_exists((path + ".jpg").c_str()))
+		path += ".jpg";
+
+	auto handle = PHYSFS_openRead(path.c_str());
+	if (handle == NULL)
+		return 0;
+
+	int length = PHYSFS_fileLength(handle);
+
+	unsigned char* tex_data = new unsigned char[length];
+
+	PHYSFS_readBytes(handle, &tex_data[0], length);
+	PHYSFS_close(handle);
+
+	GLuint id = SOIL_load_OGL_texture_from_memory(tex_data, length, channels, 0, flags);
+	delete[] tex_data;
+	return id;
+}
+
+// scripts name images with an extension, load_texture probes for its own
+static std::string strip_extension(const std::string& name)
+{
+	size_t dot = name.find_last_of('.');
+	size_t slash = name.find_last_of('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return name;
+	return name.substr(0, dot);
+}
+
+static bool plain_stage(const Stage& stage)
+{
+	return stage.tcMods.empty() && stage.animFrames.empty() && stage.alphaFunc.empty()
+		&& (stage.rgb.empty() || stage.rgb == "identity" || stage.rgb == "identitylighting")
+		&& (stage.tcGen.empty() || stage.tcGen == "base" || stage.tcGen == "lightmap");
+}
+
+// a script that's just a lightmap multiplied with a texture, in either order, is what the
+// plain texture and lightmap pass draws anyway. q3 collapses these into one pass too.
+static bool single_pass(const Shader& script)
+{
+	if (script.stages.empty())
+		return true;
+	if (script.stages.size() != 2)
+		return false;
+
+	const Stage& first = script.stages[0];
+	const Stage& second = script.stages[1];
+	bool filter = (second.BlendSrc == GL_DST_COLOR && second.BlendDst == GL_ZERO)
+		|| (second.BlendSrc == GL_ZERO && second.BlendDst == GL_SRC_COLOR);
+
+	return plain_stage(first) && plain_stage(second) && !first.hasBlend && second.hasBlend && filter
+		&& (first.map == "$lightmap") != (second.map == "$lightmap")
+		&& !first.map.empty() && !second.map.empty() && first.map != "$whiteimage" && second.map != "$whiteimage";
+}
+
 void BSPLoader::process_textures()
 {
 	for (int i = 0; i < file_textures.size(); i++)
@@ -84,6 +374,7 @@ void BSPLoader::process_textures()
 		_shader.name = file_textures[i].name;
 		if (texture.flags & SURF_NONSOLID) _shader.solid = false;
 		if (texture.flags & SURF_SKY) _shader.render = false;
+		if (texture.flags & SURF_NODRAW) _shader.render = false;
 		if (texture.contents & CONTENTS_PLAYERCLIP) _shader.solid = true;
 		if (texture.contents & CONTENTS_TRANSLUCENT) _shader.transparent = true;
 		/*if (texture.contents & CONTENTS_LAVA  || texture.contents & CONTENTS_WATER ||
@@ -92,35 +383,118 @@ void BSPLoader::process_textures()
 		if (_shader.name == "noshader") _shader.render = false;*/
 		if (_shader.name == "textures/common/caulk") _shader.render = false;
 
-		if (_shader.render)
+		// a script can hide the surface and name the image to use. the first stage with a real
+		// image stands in for the whole shader.
+		std::string file = texture.name;
+		const Shader* script = shader_scripts.find(texture.name);
+		if (script != nullptr)
 		{
-			// load the texture file
-			std::string file = texture.name;
-			std::string path = "/data/" + file;
+			if (script->nodraw || script->sky) _shader.render = false;
+			if (script->trans) _shader.transparent = true;
 
-			if (PHYSFS_exists((path + ".tga").c_str()))
-				path += ".tga";
-			else if (PHYSFS_exists((path + ".jpg").c_str()))
-				path += ".jpg";
-
-			auto handle = PHYSFS_openRead(path.c_str());
-			if (handle != NULL)
+			for (const Stage& stage : script->stages)
 			{
+				if (stage.map.empty() || stage.map[0] == '$') continue;
+				file = strip_extension(stage.map);
+				break;
+			}
 
-				int length = PHYSFS_fileLength(handle);
+			// anything more needs its stages drawn one by one
+			if (_shader.render && !single_pass(*script))
+				_shader.material = build_material(*script);
+		}
 
-				unsigned char* tex_data = new unsigned char[length];
+		if (_shader.render)
+			_shader.id = load_texture(file, 3, SOIL_FLAG_POWER_OF_TWO | SOIL_FLAG_MIPMAPS | SOIL_FLAG_TEXTURE_REPEATS);
+
+		shaders.push_back(_shader);
+	}
 
-				PHYSFS_readBytes(handle, &tex_data[0], length);
-				PHYSFS_close(handle);
+	material_order.resize(materials.size());
+	for (int i = 0; i < materials.size(); ++i)
+		material_order[i] = i;
+	std::stable_sort(material_order.begin(), material_order.end(), [this](int a, int b) {
+		if (materials[a].blended != materials[b].blended) return !materials[a].blended;
+		return materials[a].passes[0].key < materials[b].passes[0].key;
+	});
+}
 
-				_shader.id = SOIL_load_OGL_texture_from_memory(tex_data, length, 3, 0, SOIL_FLAG_POWER_OF_TWO | SOIL_FLAG_MIPMAPS | SOIL_FLAG_TEXTURE_REPEATS);
-				delete[] tex_data;
-				tex_data = nullptr;
-			}
+int BSPLoader::build_material(const Shader& script)
+{
+	material _material;
+	_material.name = script.name;
+	_material.two_sided = script.twoSided;
+
+	for (const Stage& stage : script.stages)
+	{
+		material_pass pass;
+		pass.stage = &stage;
+		pass.key = make_stage_key(stage);
+		pass.lightmap = stage.map == "$lightmap";
+
+		if (!pass.lightmap)
+		{
+			bool clamp = !stage.clamp.empty();
+			if (stage.animFrames.empty())
+				pass.frames.push_back(load_stage_texture(stage.map, clamp));
+			for (const std::string& frame : stage.animFrames)
+				pass.frames.push_back(load_stage_texture(frame, clamp));
 		}
 
-		shaders.push_back(_shader);
+		_material.passes.push_back(pass);
+	}
+
+	if (_material.passes.empty()) return -1;
+
+	_material.blended = script.stages[0].hasBlend;
+	materials.push_back(_material);
+	return (int)materials.size() - 1;
+}
+
+GLuint BSPLoader::load_stage_texture(const std::string& name, bool clamp)
+{
+	std::string key = clamp ? name + " clamp" : name;
+	auto found = stage_textures.find(key);
+	if (found != stage_textures.end())
+		return found->second;
+
+	GLuint id = 0;
+	if (name == "$whiteimage" || name == "*white")
+	{
+		const ubyte white[4] = { 255, 255, 255, 255 };
+		glGenTextures(1, &id);
+		glBindTexture(GL_TEXTURE_2D, id);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+	else
+	{
+		// stages blend with their alpha, so it's kept
+		unsigned int flags = SOIL_FLAG_POWER_OF_TWO | SOIL_FLAG_MIPMAPS;
+		if (!clamp) flags |= SOIL_FLAG_TEXTURE_REPEATS;
+		id = load_texture(strip_extension(name), SOIL_LOAD_AUTO, flags);
+	}
+
+	stage_textures.emplace(key, id);
+	return id;
+}
+
+void BSPLoader::group_material_surfaces()
+{
+	for (auto& _material : materials)
+		_material.surfaces.clear();
+
+	for (int i = 0; i < draw_surfaces.size(); ++i)
+	{
+		if (draw_surfaces[i].material >= 0)
+			materials[draw_surfaces[i].material].surfaces.push_back(i);
+	}
+
+	for (auto& _material : materials)
+	{
+		std::stable_sort(_material.surfaces.begin(), _material.surfaces.end(),
+			[this](int a, int b) { return draw_surfaces[a].lightmap < draw_surfaces[b].lightmap; });
 	}
 }
 
@@ -201,9 +575,11 @@ void BSPLoader::combine_lightmaps()
 	}
 }
 
-void BSPLoader::update_lm_coords()
+void BSPLoader::update_lm_coords(int first_vertex)
 {
 	int lm_count = file_lightmaps.size();
+	// vertices are shared between triangles (and faces, once welded) so only rescale each once.
+	std::vector<bool> rescaled(file_vertices.size(), false);
 	// loop the faces
 	// for each face, loop the verts
 	// re-scale the lm u coord to a new 0 - 1 range based on the lm index, v stays the same.
@@ -216,6 +592,8 @@ void BSPLoader::update_lm_coords()
 			if (_face.lm_index < 0) _face.lm_index = lm_count;
 			int vertIndex = _face.meshvert + j;
 			int index = indices[vertIndex];
+			if (index < first_vertex || rescaled[index]) continue;
+			rescaled[index] = true;
 			float coord = file_vertices[index].lmtexcoord[0];
 
 			// rescale u coord to fit the atlas.
@@ -226,6 +604,137 @@ void BSPLoader::update_lm_coords()
 	}
 }
 
+void BSPLoader::build_render_data()
+{
+	render_vertices.clear();
+	render_indices.clear();
+	draw_surfaces.clear();
+	meshlets.clear();
+
+	// patches go last so they can be rebuilt without touching the rest
+	append_render_faces(false);
+
+	render_patch_region.first_vertex = render_vertices.size();
+	render_patch_region.first_index = render_indices.size();
+	static_surface_count = draw_surfaces.size();
+	static_meshlet_count = meshlets.size();
+
+	append_render_faces(true);
+	group_material_surfaces();
+}
+
+void BSPLoader::append_render_faces(bool patches)
+{
+	// copy out just the faces that get drawn. caulk, sky and the like stay in the full set
+	// for collision but never reach the gpu, and the draw loop doesn't have to skip them.
+	const unsigned int unused = ~0u;
+	std::vector<unsigned int> remap(file_vertices.size(), unused);
+
+	int first_surface = draw_surfaces.size();
+
+	for (int i = 0; i < file_faces.size(); ++i)
+	{
+		const face& _face = file_faces[i];
+		if (_face.type == FaceTypes::Billboard || _face.n_meshverts == 0) continue;
+		if ((_face.type == FaceTypes::Patch) != patches) continue;
+
+		const shader& _shader = shaders[_face.texture];
+		if (!_shader.render) continue;
+
+		int first = render_indices.size();
+		for (int j = 0; j < _face.n_meshverts; ++j)
+		{
+			unsigned int index = indices[_face.meshvert + j];
+			if (remap[index] == unused)
+			{
+				remap[index] = render_vertices.size();
+				render_vertices.push_back(file_vertices[index]);
+			}
+			render_indices.push_back(remap[index]);
+		}
+
+		// fog surfaces are uploaded but not drawn yet, nor is anything see-through without a
+		// script to say how it blends
+		if (_face.effect >= 0 || (_shader.transparent && _shader.material < 0)) continue;
+
+		// right now, we'll assign a "default" lightmap to a surface without a valid index.
+		int lm = _face.lm_index < 0 ? get_default_lightmap() : _face.lm_index;
+
+		// like q3, a surface without a lightmap is lit by its vertex colours instead
+		draw_surfaces.push_back(draw_surface{ i, first, _face.n_meshverts, 0, 0, _shader.id, lightmaps[lm].id, _face.lm_index < 0, _shader.material });
+	}
+
+	if (render_indices.empty()) return;
+
+	// split the drawn surfaces into meshlets so they can be culled piece by piece
+	for (int i = first_surface; i < draw_surfaces.size(); ++i)
+	{
+		draw_surface& surface = draw_surfaces[i];
+		int count = meshlets.size();
+		// cull none surfaces are seen from behind too
+		bool two_sided = surface.material >= 0 && materials[surface.material].two_sided;
+		surface.first_meshlet = meshlets.add_surface(&render_indices[0], surface.meshvert, surface.n_meshverts,
+			&render_vertices[0].position.x, &render_vertices[0].normal.x, sizeof(vertex), two_sided);
+		surface.n_meshlets = meshlets.size() - count;
+	}
+}
+
+void BSPLoader::set_tessellation_settings(tessellation_settings settings)
+{
+	tessellation_config = settings;
+	if (loaded)
+		rebuild_patches();
+}
+
+void BSPLoader::rebuild_patches()
+{
+	// throw away the patch region of both vertex sets and tessellate it again. everything
+	// in front of it, and so everything already on the gpu there, is left as it is.
+	file_vertices.resize(patch_region.first_vertex);
+	indices.resize(patch_region.first_index);
+
+	tesselate_patches();
+	weld_vertices(true);
+	optimize_indices(true);
+
+	if (single_draw && file_lightmaps.size() >= 2)
+		update_lm_coords(patch_region.first_vertex);
+
+	render_vertices.resize(render_patch_region.first_vertex);
+	render_indices.resize(render_patch_region.first_index);
+	draw_surfaces.resize(static_surface_count);
+	meshlets.truncate(static_meshlet_count);
+
+	append_render_faces(true);
+	group_material_surfaces();
+}
+
+static cache_stats combine_stats(const cache_stats& a, const cache_stats& b)
+{
+	cache_stats result;
+	result.triangles = a.triangles + b.triangles;
+	if (result.triangles > 0)
+	{
+		result.acmr_before = (a.acmr_before * a.triangles + b.acmr_before * b.triangles) / result.triangles;
+		result.acmr_after = (a.acmr_after * a.triangles + b.acmr_after * b.triangles) / result.triangles;
+	}
+	return result;
+}
+
+cache_stats BSPLoader::get_cache_stats() const
+{
+	return combine_stats(static_cache, patch_cache);
+}
+
+weld_stats BSPLoader::get_weld_stats() const
+{
+	weld_stats result;
+	result.groups = static_weld.groups + patch_weld.groups;
+	result.vertices_before = static_weld.vertices_before + patch_weld.vertices_before;
+	result.vertices_after = static_weld.vertices_after + patch_weld.vertices_after;
+	return result;
+}
+
 void BSPLoader::clear_memory()
 {
 	for (auto shader : shaders)
@@ -238,228 +747,673 @@ void BSPLoader::clear_memory()
 		glDeleteTextures(1, &lm.id);
 	}
 
+	for (auto& stage_texture : stage_textures)
+	{
+		glDeleteTextures(1, &stage_texture.second);
+	}
+
 	shaders.resize(0);
 	lightmaps.resize(0);
+	stage_textures.clear();
+	materials.clear();
+	material_order.clear();
 	indices.resize(0);
+	render_vertices.resize(0);
+	render_indices.resize(0);
+	draw_surfaces.resize(0);
+	meshlets.clear();
+	// the models stay parsed in the cache, the next map may want them
+	for (const auto& mesh : model_meshes)
+		model_cache.release_lods(mesh.name, mesh.lod_count);
+	model_vertices.resize(0);
+	model_indices.resize(0);
+	model_meshes.resize(0);
+	model_surfaces.resize(0);
+	model_instances.resize(0);
+	entity_store.clear();
+	static_cache = cache_stats{};
+	patch_cache = cache_stats{};
+	static_weld = weld_stats{};
+	patch_weld = weld_stats{};
 }
 
-void BSPLoader::load_models()
+void BSPLoader::build_light_grid()
 {
-	// parse the entity lump
-	EntityParser parser;
+	static_assert(sizeof(lightvol) == 8, "light grid cells are 8 bytes");
+
+	if (file_models.empty() || file_lightvols.empty())
+	{
+		light_grid.clear();
+		return;
+	}
 
-	std::vector<entity> entities;
-	parser.parse(file_entities.ents, entities);
+	// the grid spans the world model, model 0
+	const model& world = file_models[0];
+	light_grid.build(&file_lightvols[0].ambient[0], (int)file_lightvols.size(),
+		glm::vec3(world.mins[0], world.mins[1], world.mins[2]), glm::vec3(world.maxs[0], world.maxs[1], world.maxs[2]));
+}
 
-	// store the data in the models vector.
-	for (int i = 0; i < entities.size(); ++i)
+// placement of a misc_model the way q3map2 reads it: "angle" is a yaw, "angles" is pitch yaw
+// roll, and "modelscale" or "modelscale_vec" scale the model before it's rotated into place.
+static glm::mat4 model_transform(const stored_entity& ent)
+{
+	glm::vec3 scale(1.f);
+	if (ent.fields.has("modelscale"))
+		scale = glm::vec3(ent.fields.get_float("modelscale"));
+	ent.fields.get_vec3("modelscale_vec", scale);
+
+	// angles are pitch, yaw, roll
+	glm::mat4 transform = glm::translate(glm::mat4(1.f), ent.origin);
+	transform = glm::rotate(transform, glm::radians(ent.angles.y), glm::vec3(0.f, 0.f, 1.f));
+	transform = glm::rotate(transform, glm::radians(ent.angles.x), glm::vec3(0.f, 1.f, 0.f));
+	transform = glm::rotate(transform, glm::radians(ent.angles.z), glm::vec3(1.f, 0.f, 0.f));
+	return glm::scale(transform, scale);
+}
+
+void BSPLoader::load_models()
+{
+	// every md3 is loaded once, however many misc_models use it. -1 for ones that failed.
+	std::map<std::string, int> mesh_lookup;
+	std::map<std::string, int> texture_lookup;
+	std::vector<glm::vec3> origins;
+
+	for (int index : entity_store.of_class("misc_model"))
 	{
-		// pull out any misc_model entries
-		if (entities[i].get_string("classname") != "misc_model") continue;
-	
-		// load the relevant md3
-		std::string filename = entities[i].get_string("model");
+		const stored_entity& ent = entity_store.get(index);
+		if (ent.model.empty()) continue;
 
-		if (filename == "") continue;
+		std::string filename(ent.model);
+		auto found = mesh_lookup.find(filename);
+		if (found == mesh_lookup.end())
+			found = mesh_lookup.emplace(filename, load_model_mesh(filename, texture_lookup)).first;
 
-		std::string path = "data/" + filename;
+		if (found->second < 0) continue;
 
-		Model model; 
-		bool loaded = MD3Loader::Load(model, path);
+		model_instance instance;
+		instance.mesh = found->second;
+		instance.transform = model_transform(ent);
+		model_instances.push_back(instance);
+		origins.push_back(ent.origin);
+	}
 
-		if (!loaded) continue;
+	// models have no lightmap, they get the light grid at their origin instead. sampled in
+	// one batch once they're all placed.
+	std::vector<light_sample> lights(origins.size());
+	light_grid.sample(origins.data(), (int)origins.size(), lights.data());
+	size_t first = model_instances.size() - origins.size();
+	for (size_t i = 0; i < lights.size(); ++i)
+		model_instances[first + i].light = lights[i];
 
-		model.LoadSurfaceAssets();
+	// whatever the last map placed and this one doesn't can go now
+	model_cache.purge();
+}
 
-		float angle = entities[i].get_float("angle");
-		glm::vec3 origin;
-		entities[i].get_vec3("origin", origin);
-		angle = angle / 180 * M_PI;
-		float angleCos = cos(angle);
-		float angleSin = sin(angle);
+int BSPLoader::load_model_mesh(const std::string& name, std::map<std::string, int>& texture_lookup)
+{
+	const Model* lods[MaxModelLods];
+	int lod_count = model_cache.acquire_lods(name, lods);
+	if (lod_count == 0) return -1;
 
-		std::vector<Surface> md3surfaces = model.GetSurfaces();
-		for (auto surface : md3surfaces)
-		{
-			// convert the models surfaces into bsp style faces...
-			face _face;
+	model_mesh mesh;
+	mesh.name = name;
+	mesh.model = lods[0];
+	mesh.lod_count = lod_count;
+	mesh.radius = lods[0]->FrameCount() > 0 ? lods[0]->GetFrames()[0].radius : 0.f;
+
+	for (int level = 0; level < lod_count; ++level)
+	{
+		model_lod& lod = mesh.lods[level];
+		lod.first_surface = (int)model_surfaces.size();
+		lod.n_surfaces = 0;
+		lod.n_triangles = 0;
 
-			_face.texture = file_textures.size();
+		for (const auto& surface : lods[level]->GetSurfaces())
+		{
+			if (surface.shaders.empty() || surface.vertices.empty()) continue;
 
-			for (auto shade : surface.shaders)
+			// one texture entry per skin, shared by every surface and model that uses it
+			const std::string& skin = surface.shaders[0].name;
+			auto found = texture_lookup.find(skin);
+			if (found == texture_lookup.end())
 			{
 				texture tex;
-				shade.name.copy(tex.name, 64);
-				tex.name[shade.name.size()] = '\0';
+				skin.copy(tex.name, 63);
+				tex.name[std::min<size_t>(skin.size(), 63)] = '\0';
 				tex.flags = 0;
 				tex.contents = 0;
+				found = texture_lookup.emplace(skin, (int)file_textures.size()).first;
 				file_textures.push_back(tex);
 			}
 
-			_face.type = 3;
-			_face.effect = -1;
-			_face.lm_index = -1;
-			_face.n_vertexes = surface.vertices.size();
-			_face.vertex = file_vertices.size();
-
-			_face.n_meshverts = surface.triangles.size() * 3;
-			_face.meshvert = file_meshverts.size();
+			model_surface _surface;
+			_surface.texture = found->second;
+			_surface.first_index = (int)model_indices.size();
+			_surface.n_indices = (int)surface.triangles.size() * 3;
 
-			for (int i = 0; i < surface.triangles.size(); ++i)
+			unsigned int base = (unsigned int)model_vertices.size();
+			for (const auto& triangle : surface.triangles)
 			{
-				meshvert vertA { surface.triangles[i].indexes[0] };
-				meshvert vertB { surface.triangles[i].indexes[1] };
-				meshvert vertC { surface.triangles[i].indexes[2] };
-				file_meshverts.push_back(vertA);
-				file_meshverts.push_back(vertB);
-				file_meshverts.push_back(vertC);
+				model_indices.push_back(base + triangle.indexes[0]);
+				model_indices.push_back(base + triangle.indexes[1]);
+				model_indices.push_back(base + triangle.indexes[2]);
 			}
 
-			for (int i = 0; i < _face.n_vertexes; ++i)
+			// map models sit in their first frame
+			const MD3Vertex* frame = surface.Frame(0);
+			const glm::vec3* normals = MD3Loader::NormalTable();
+			for (int i = 0; i < surface.header.num_verts; ++i)
 			{
-				auto surfvert = surface.vertices[i];
-				vertex vert;
-				vert.colour[0] = 255;
-				vert.colour[1] = 255;
-				vert.colour[2] = 255;
-				vert.colour[3] = 255;
-
-				vert.dtexcoord[0] = surface.texcoords[i].st.r;
-				vert.dtexcoord[1] = surface.texcoords[i].st.g;
-
-				vert.lmtexcoord[0] = 0;
-				vert.lmtexcoord[1] = 0;
-
-				vert.position[0] = origin.x + MD3_XYZ_SCALE * (surfvert.vert.x * angleCos - surfvert.vert.y * angleSin);
-				vert.position[1] = origin.y + MD3_XYZ_SCALE * (surfvert.vert.x * angleSin + surfvert.vert.y * angleCos);
-				vert.position[2] = origin.z + MD3_XYZ_SCALE * (surfvert.vert.z);
-
-				float lat = (surfvert.normal >> 8) & 0xff;
-				float lng = (surfvert.normal & 0xff);
-				lat *= M_PI / 128;
-				lng *= M_PI / 128;
-
-				glm::vec3 temp;
-				temp.x = cos(lat) * sin(lng);
-				temp.y = sin(lat) * sin(lng);
-				temp.z = cos(lng);
-
-				vert.normal[0] = temp.x * angleCos - temp.y * angleSin;
-				vert.normal[1] = temp.x * angleSin + temp.y * angleCos;
-				vert.normal[2] = temp.z;
-
-				file_vertices.push_back(vert);
+				const MD3Vertex& surfvert = frame[i];
+				model_vertex vert;
+
+				vert.position = glm::vec3(surfvert.vert) * MD3_XYZ_SCALE;
+				vert.texcoord = surface.texcoords[i].st;
+
+				vert.normal = normals[(unsigned short)surfvert.normal];
+
+				model_vertices.push_back(vert);
 			}
 
-			file_faces.push_back(_face);
+			model_surfaces.push_back(_surface);
+			lod.n_surfaces++;
+			lod.n_triangles += (int)surface.triangles.size();
 		}
-		models.push_back(model);
 	}
+
+	model_meshes.push_back(mesh);
+	return (int)model_meshes.size() - 1;
 }
 
-void BSPLoader::tesselate(int controlOffset, int controlWidth, int vOffset, int iOffset)
+// subdivisions needed along one quadratic curve so no segment strays more than max_error
+// from the real curve. the chord error of a segment of length 1/n is |p0 - 2p1 + p2| / 4n^2.
+static int curve_level(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const tessellation_settings& settings)
 {
-	vertex controls[9];
-	int cIndex = 0;
-	for (int c = 0; c < 3; ++c)
+	float deviation = glm::length(p0 - p1 * 2.f + p2);
+	int level = (int)ceilf(sqrtf(deviation / (4.f * settings.max_error)));
+
+	level = std::min(std::max(level, settings.min_level), settings.max_level);
+	return std::min(std::max(level, 1), MaxBezierLevel);
+}
+
+void BSPLoader::patch_levels(int controlOffset, int controlWidth, int& levelU, int& levelV) const
+{
+	levelU = 1;
+	levelV = 1;
+
+	for (int k = 0; k < 3; ++k)
 	{
-		int pos = c * controlWidth;
-		controls[cIndex++] = file_vertices[controlOffset + pos];
-		controls[cIndex++] = file_vertices[controlOffset + pos + 1];
-		controls[cIndex++] = file_vertices[controlOffset + pos + 2];
+		// rows run along u, columns along v
+		const vertex* row = &file_vertices[controlOffset + k * controlWidth];
+		levelU = std::max(levelU, curve_level(row[0].position, row[1].position, row[2].position, tessellation_config));
+
+		const vertex* column = &file_vertices[controlOffset + k];
+		levelV = std::max(levelV, curve_level(column[0].position, column[controlWidth].position, column[controlWidth * 2].position, tessellation_config));
 	}
+}
+
+void BSPLoader::tesselate(const sub_patch& patch)
+{
+	// the sub-patch's block of the face grid. the far row and column belong to the next
+	// sub-patch along unless this one is on the edge of the face.
+	BezierKernel::evaluate(&file_vertices[patch.control], patch.width, patch.levelU, patch.levelV,
+		patch.rows, patch.cols, &file_vertices[patch.vOffset + patch.gridU * patch.stride + patch.gridV], patch.stride);
 
-	int L1 = bezierLevel + 1;
+	int L1 = patch.stride;
+	int quads = patch.stride - 1;
 
-	for (int j = 0; j <= bezierLevel; ++j)
+	for (int i = patch.gridU; i < patch.gridU + patch.levelU; ++i)
 	{
-		float a = (float)j / bezierLevel;
-		float b = 1.f - a;
-		file_vertices[vOffset + j] = controls[0] * b * b + controls[3] * 2 * b * a + controls[6] * a * a;
+		for (int j = patch.gridV; j < patch.gridV + patch.levelV; ++j)
+		{
+			int offset = patch.iOffset + (i * quads + j) * 6;
+			indices[offset + 0] = (i    ) * L1 + (j    ) + patch.vOffset;
+			indices[offset + 1] = (i    ) * L1 + (j + 1) + patch.vOffset;
+			indices[offset + 2] = (i + 1) * L1 + (j + 1) + patch.vOffset;
+			indices[offset + 3] = (i + 1) * L1 + (j + 1) + patch.vOffset;
+			indices[offset + 4] = (i + 1) * L1 + (j    ) + patch.vOffset;
+			indices[offset + 5] = (i    ) * L1 + (j    ) + patch.vOffset;
+		}
 	}
+}
 
-	for (int i = 1; i <= bezierLevel; ++i)
+void BSPLoader::build_patch_grids(std::vector<patch_grid>& grids, std::vector<int>& levels) const
+{
+	for (int f = 0; f < file_faces.size(); ++f)
 	{
-		float a = (float)i / bezierLevel;
-		float b = 1.f - a;
+		const face& _face = file_faces[f];
+		if (_face.type != FaceTypes::Patch) continue;
+
+		patch_grid grid;
+		grid.face = f;
+		grid.dimX = (_face.size[0] - 1) / 2;
+		grid.dimY = (_face.size[1] - 1) / 2;
+		grid.level_offset = levels.size();
+		if (grid.dimX <= 0 || grid.dimY <= 0) continue;
+
+		// every sub-patch in a column shares its u level and every sub-patch in a row its
+		// v level, so neighbours meet with the same vertices along their seam.
+		levels.resize(levels.size() + grid.dimX + grid.dimY, 1);
+		int* levelsU = &levels[grid.level_offset];
+		int* levelsV = levelsU + grid.dimX;
+
+		for (int n = 0; n < grid.dimX; ++n)
+		{
+			for (int m = 0; m < grid.dimY; ++m)
+			{
+				int levelU, levelV;
+				patch_levels(_face.vertex + 2 * n + _face.size[0] * 2 * m, _face.size[0], levelU, levelV);
+				levelsU[n] = std::max(levelsU[n], levelU);
+				levelsV[m] = std::max(levelsV[m], levelV);
+			}
+		}
 
-		vertex temp[3];
+		grids.push_back(grid);
+	}
+}
+
+// a boundary edge of a patch face: three control points and the level slot that
+// decides how finely it is split
+struct patch_edge
+{
+	unsigned long long hash;
+	int control[3];		// ordered so the same edge seen from either face matches
+	int level;
+};
+
+static int find_level(std::vector<int>& parent, int slot)
+{
+	while (parent[slot] != slot)
+	{
+		parent[slot] = parent[parent[slot]];
+		slot = parent[slot];
+	}
+	return slot;
+}
+
+static bool positions_less(const glm::vec3& a, const glm::vec3& b)
+{
+	if (a.x != b.x) return a.x < b.x;
+	if (a.y != b.y) return a.y < b.y;
+	return a.z < b.z;
+}
 
-		for (int j = 0; j < 3; ++j)
+int BSPLoader::stitch_patch_grids(const std::vector<patch_grid>& grids, std::vector<int>& levels) const
+{
+	// like q3's patch stitching: two faces that share an edge have to split it the same
+	// number of times or the seam opens up into t-junction cracks. every level slot whose
+	// edges touch becomes one set, and the whole set takes the finest level in it.
+	// only edges whose three control points all match are linked. where one face's edge
+	// covers part of another's, q3 inserts extra columns into the grid (R_StitchPatches),
+	// which uniform levels can't express, so those seams can still crack.
+	std::vector<patch_edge> edges;
+
+	auto add_edge = [&](int a, int b, int c, int level) {
+		const glm::vec3& pa = file_vertices[a].position;
+		const glm::vec3& pc = file_vertices[c].position;
+		if (pa == pc) return;	// collapsed edge, it would tie together unrelated faces
+		if (positions_less(pc, pa)) std::swap(a, c);
+
+		patch_edge edge;
+		edge.hash = position_hash(file_vertices[a].position, 0.f) ^ (position_hash(file_vertices[b].position, 0.f) * 31)
+			^ (position_hash(file_vertices[c].position, 0.f) * 961);
+		edge.control[0] = a;
+		edge.control[1] = b;
+		edge.control[2] = c;
+		edge.level = level;
+		edges.push_back(edge);
+	};
+
+	for (auto& grid : grids)
+	{
+		const face& _face = file_faces[grid.face];
+		int width = _face.size[0];
+		int first = _face.vertex;
+		int last = first + width * (_face.size[1] - 1);
+
+		// edges along u on the first and last control rows, along v on the first and last columns
+		for (int n = 0; n < grid.dimX; ++n)
+		{
+			add_edge(first + 2 * n, first + 2 * n + 1, first + 2 * n + 2, grid.level_offset + n);
+			add_edge(last + 2 * n, last + 2 * n + 1, last + 2 * n + 2, grid.level_offset + n);
+		}
+		for (int m = 0; m < grid.dimY; ++m)
 		{
-			int k = 3 * j;
-			temp[j] = controls[k + 0] * b * b + controls[k + 1] * 2 * b * a + controls[k + 2] * a * a;
+			int row = first + width * 2 * m;
+			int level = grid.level_offset + grid.dimX + m;
+			add_edge(row, row + width, row + width * 2, level);
+			add_edge(row + width - 1, row + width * 2 - 1, row + width * 3 - 1, level);
 		}
+	}
+
+	std::sort(edges.begin(), edges.end(), [](const patch_edge& a, const patch_edge& b) { return a.hash < b.hash; });
+
+	std::vector<int> parent(levels.size());
+	for (int i = 0; i < parent.size(); ++i)
+		parent[i] = i;
+
+	for (size_t run = 0; run < edges.size();)
+	{
+		size_t run_end = run + 1;
+		while (run_end < edges.size() && edges[run_end].hash == edges[run].hash) ++run_end;
 
-		for (int j = 0; j <= bezierLevel; ++j)
+		for (size_t a = run; a < run_end; ++a)
 		{
-			float a = (float)j / bezierLevel;
-			float b = 1.f - a;
+			for (size_t b = a + 1; b < run_end; ++b)
+			{
+				bool same = true;
+				for (int k = 0; k < 3 && same; ++k)
+					same = file_vertices[edges[a].control[k]].position == file_vertices[edges[b].control[k]].position;
+				if (!same) continue;
+
+				int ra = find_level(parent, edges[a].level);
+				int rb = find_level(parent, edges[b].level);
+				if (ra != rb) parent[rb] = ra;
+			}
+		}
+
+		run = run_end;
+	}
+
+	std::vector<int> finest(levels.size(), 0);
+	for (int i = 0; i < levels.size(); ++i)
+	{
+		int root = find_level(parent, i);
+		finest[root] = std::max(finest[root], levels[i]);
+	}
 
-			file_vertices[vOffset + i * L1 + j] = temp[0] * b * b + temp[1] * 2 * b * a + temp[2] * a * a;
+	int raised = 0;
+	for (int i = 0; i < levels.size(); ++i)
+	{
+		int level = finest[find_level(parent, i)];
+		if (level != levels[i])
+		{
+			levels[i] = level;
+			raised++;
 		}
 	}
 
-	for (int i = 0; i <= bezierLevel; ++i)
+	return raised;
+}
+
+void BSPLoader::layout_patch_grids(std::vector<patch_grid>& grids, const std::vector<int>& levels, std::vector<sub_patch>& sub_patches)
+{
+	// prefix sum the grid sizes, every face then owns a fixed block of the buffers and every
+	// sub-patch a fixed part of that, so the result doesn't depend on which thread does what.
+	int vOffset = file_vertices.size();
+	int iOffset = indices.size();
+
+	for (auto& grid : grids)
 	{
-		for (int j = 0; j <= bezierLevel; ++j)
+		const int* levelsU = &levels[grid.level_offset];
+		const int* levelsV = levelsU + grid.dimX;
+
+		grid.width = 1;
+		grid.height = 1;
+		for (int n = 0; n < grid.dimX; ++n) grid.width += levelsU[n];
+		for (int m = 0; m < grid.dimY; ++m) grid.height += levelsV[m];
+
+		grid.vOffset = vOffset;
+		grid.iOffset = iOffset;
+		vOffset += grid.width * grid.height;
+		iOffset += (grid.width - 1) * (grid.height - 1) * 6;
+
+		face& _face = file_faces[grid.face];
+		_face.meshvert = grid.iOffset;
+		_face.n_meshverts = iOffset - grid.iOffset;
+
+		for (int n = 0, gridU = 0; n < grid.dimX; gridU += levelsU[n], ++n)
 		{
-			int offset = iOffset + (i * bezierLevel + j) * 6;
-			//if(offset+5 >= indices.size()) break;
-			indices[offset + 0] = (i    ) * L1 + (j    ) + vOffset;
-			indices[offset + 1] = (i    ) * L1 + (j + 1) + vOffset;
-			indices[offset + 2] = (i + 1) * L1 + (j + 1) + vOffset;
-			indices[offset + 3] = (i + 1) * L1 + (j + 1) + vOffset;
-			indices[offset + 4] = (i + 1) * L1 + (j    ) + vOffset;
-			indices[offset + 5] = (i    ) * L1 + (j    ) + vOffset;
+			for (int m = 0, gridV = 0; m < grid.dimY; gridV += levelsV[m], ++m)
+			{
+				sub_patch patch;
+				patch.control = _face.vertex + 2 * n + _face.size[0] * 2 * m;
+				patch.width = _face.size[0];
+				patch.levelU = levelsU[n];
+				patch.levelV = levelsV[m];
+				patch.rows = levelsU[n] + (n == grid.dimX - 1 ? 1 : 0);
+				patch.cols = levelsV[m] + (m == grid.dimY - 1 ? 1 : 0);
+				patch.gridU = gridU;
+				patch.gridV = gridV;
+				patch.stride = grid.height;
+				patch.vOffset = grid.vOffset;
+				patch.iOffset = grid.iOffset;
+				sub_patches.push_back(patch);
+			}
 		}
 	}
+
+	file_vertices.resize(vOffset);
+	indices.resize(iOffset);
 }
 
-void BSPLoader::tesselate_patches()
+// how far the kernel may drift from the reference, relative to the patch's size, before the
+// benchmark fails. the two sum in different orders so they aren't expected to match exactly.
+const float MaxTessellationError = 1e-5f;
+
+tessellation_benchmark BSPLoader::benchmark_tessellation(int repeats) const
 {
-	int bezierCount = 0;
-	int bezierPatchSize = (bezierLevel + 1) * (bezierLevel + 1);
-	int bezierIndexSize = bezierLevel * bezierLevel * 6;
+	// run both bezier paths over this map's patches and compare what they produce
+	std::vector<sub_patch> sub_patches;
+	int vertexCount = 0;
 
 	for (auto& face : file_faces)
 	{
 		if (face.type != FaceTypes::Patch) continue;
 		int dimX = (face.size[0] - 1) / 2;
 		int dimY = (face.size[1] - 1) / 2;
-		int size = dimX * dimY;
-		bezierCount += size;
+
+		for (int n = 0; n < dimX; ++n)
+		{
+			for (int m = 0; m < dimY; ++m)
+			{
+				sub_patch patch;
+				patch.control = face.vertex + 2 * n + face.size[0] * 2 * m;
+				patch.width = face.size[0];
+				patch_levels(patch.control, patch.width, patch.levelU, patch.levelV);
+				patch.vOffset = vertexCount;
+				vertexCount += (patch.levelU + 1) * (patch.levelV + 1);
+				sub_patches.push_back(patch);
+			}
+		}
 	}
 
-	int iOffset = indices.size();
-	int vOffset = file_vertices.size();
+	tessellation_benchmark result;
 
-	int meshIndexCount = file_directory.direntries[11].length / sizeof(int);
-	int newICount = meshIndexCount + bezierCount * bezierIndexSize;
+	if (vertexCount == 0) return result;
 
-	file_vertices.resize(file_vertices.size() + (bezierPatchSize * bezierCount));
-	indices.resize(newICount);
+	std::vector<vertex> reference(vertexCount);
+	std::vector<vertex> kernel(vertexCount);
 
-	for (auto& face : file_faces)
+	auto run = [&](bool use_kernel, std::vector<vertex>& out) {
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < repeats; ++r)
+		{
+			for (auto& patch : sub_patches)
+			{
+				int L1 = patch.levelV + 1;
+				if (use_kernel)
+					BezierKernel::evaluate(&file_vertices[patch.control], patch.width, patch.levelU, patch.levelV,
+						patch.levelU + 1, L1, &out[patch.vOffset], L1);
+				else
+					BezierKernel::evaluate_reference(&file_vertices[patch.control], patch.width, patch.levelU, patch.levelV,
+						patch.levelU + 1, L1, &out[patch.vOffset], L1);
+			}
+		}
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		return elapsed.count();
+	};
+
+	double reference_time = run(false, reference);
+	double kernel_time = run(true, kernel);
+
+	result.vertices = vertexCount;
+	result.reference_rate = reference_time > 0 ? vertexCount * repeats / reference_time : 0;
+	result.kernel_rate = kernel_time > 0 ? vertexCount * repeats / kernel_time : 0;
+
+	// errors are relative to the largest control value of the same kind, the kernel and the
+	// reference round differently and a point on a big patch can cancel down to near 0
+	auto channels = [](const vertex& v, float* out) {
+		for (int k = 0; k < 3; ++k)
+		{
+			out[k] = v.position[k];
+			out[3 + k] = v.normal[k];
+		}
+		for (int k = 0; k < 2; ++k)
+		{
+			out[6 + k] = v.dtexcoord[k];
+			out[8 + k] = v.lmtexcoord[k];
+		}
+	};
+
+	for (auto& patch : sub_patches)
 	{
-		if (face.type != FaceTypes::Patch) continue;
-		int dimX = (face.size[0] - 1) / 2;
-		int dimY = (face.size[1] - 1) / 2;
+		float scale[10], value[10], expected[10];
+		for (int c = 0; c < 10; ++c)
+			scale[c] = 1.f;
+		for (int y = 0; y < 3; ++y)
+		{
+			for (int x = 0; x < 3; ++x)
+			{
+				channels(file_vertices[patch.control + y * patch.width + x], value);
+				for (int c = 0; c < 10; ++c)
+					scale[c] = std::max(scale[c], fabsf(value[c]));
+			}
+		}
+
+		int count = (patch.levelU + 1) * (patch.levelV + 1);
+		for (int i = patch.vOffset; i < patch.vOffset + count; ++i)
+		{
+			const vertex& a = reference[i];
+			const vertex& b = kernel[i];
+
+			channels(a, expected);
+			channels(b, value);
+			for (int c = 0; c < 10; ++c)
+				result.max_error = std::max(result.max_error, fabsf(expected[c] - value[c]) / scale[c]);
+
+			if (memcmp(&a, &b, sizeof(vertex)) != 0) result.mismatches++;
+			for (int k = 0; k < 4; ++k)
+				result.colour_error = std::max(result.colour_error, abs((int)a.colour[k] - (int)b.colour[k]));
+		}
+	}
 
-		face.meshvert = iOffset;
+	// patch stitching relies on a shared edge coming out the same from either face, so every
+	// patch evaluated with its control rows the other way round has to be a mirror image
+	std::vector<vertex> reversed;
+	for (auto& patch : sub_patches)
+	{
+		int L1 = patch.levelV + 1;
+		reversed.resize((patch.levelU + 1) * L1);
+		BezierKernel::evaluate(&file_vertices[patch.control + 2 * patch.width], -patch.width, patch.levelU, patch.levelV,
+			patch.levelU + 1, L1, &reversed[0], L1);
 
-		for (int x = 0, n = 0; n < dimX; n++, x = 2 * n)
+		for (int i = 0; i <= patch.levelU; ++i)
 		{
-			for (int y = 0, m = 0; m < dimY; m++, y = 2 * m)
+			for (int j = 0; j <= patch.levelV; ++j)
 			{
-				tesselate(face.vertex + x + face.size[0] * y, face.size[0], vOffset, iOffset);
-				vOffset += bezierPatchSize;
-				iOffset += bezierIndexSize;
+				if (memcmp(&reversed[i * L1 + patch.levelV - j], &kernel[patch.vOffset + i * L1 + j], sizeof(vertex)) != 0)
+					result.asymmetric++;
 			}
 		}
+	}
+
+	result.passed = result.max_error <= MaxTessellationError && result.colour_error <= 1 && result.asymmetric == 0;
+	return result;
+}
+
+// how far a blended position (in units) or normal can be from the reference before the
+// benchmark fails. the kernel scales positions after blending rather than before.
+const float MaxAnimationError = 1e-3f;
 
-		face.n_meshverts = iOffset - face.meshvert;
+animation_benchmark BSPLoader::benchmark_animation(int repeats) const
+{
+	std::vector<md3_lerp> surfaces;
+	int vertexCount = 0;
+
+	for (const auto& mesh : model_meshes)
+	{
+		int last = std::max(mesh.model->FrameCount() - 1, 0);
+		for (const auto& surface : mesh.model->GetSurfaces())
+		{
+			if (surface.vertices.empty()) continue;
+
+			md3_lerp lerp;
+			lerp.from = surface.Frame(0);
+			lerp.to = surface.Frame(std::min(last, surface.header.num_frames - 1));
+			lerp.count = surface.header.num_verts;
+			lerp.fraction = 0.5f;
+			lerp.out = nullptr;
+			surfaces.push_back(lerp);
+			vertexCount += lerp.count;
+		}
 	}
+
+	animation_benchmark result;
+
+	if (vertexCount == 0) return result;
+
+	std::vector<model_vertex> reference(vertexCount);
+	std::vector<model_vertex> kernel(vertexCount);
+
+	auto run = [&](bool use_kernel, std::vector<model_vertex>& out) {
+		int offset = 0;
+		for (auto& lerp : surfaces)
+		{
+			lerp.out = &out[offset];
+			offset += lerp.count;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < repeats; ++r)
+		{
+			if (use_kernel)
+				MD3Kernel::lerp(surfaces.data(), (int)surfaces.size());
+			else
+				MD3Kernel::lerp_reference(surfaces.data(), (int)surfaces.size());
+		}
+		std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+		return elapsed.count();
+	};
+
+	double reference_time = run(false, reference);
+	double kernel_time = run(true, kernel);
+
+	result.vertices = vertexCount;
+	result.reference_rate = reference_time > 0 ? vertexCount * repeats / reference_time : 0;
+	result.kernel_rate = kernel_time > 0 ? vertexCount * repeats / kernel_time : 0;
+
+	for (int i = 0; i < vertexCount; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			result.max_error = std::max(result.max_error, fabsf(reference[i].position[k] - kernel[i].position[k]));
+			result.max_error = std::max(result.max_error, fabsf(reference[i].normal[k] - kernel[i].normal[k]));
+		}
+	}
+
+	result.passed = result.max_error <= MaxAnimationError;
+	return result;
+}
+
+void BSPLoader::tesselate_patches()
+{
+	// each patch face becomes one continuous grid, with the levels picked per column and row
+	// of sub-patches so the output can be sized up front
+	std::vector<patch_grid> grids;
+	std::vector<int> levels;
+	build_patch_grids(grids, levels);
+
+	patch_region.first_vertex = file_vertices.size();
+	patch_region.first_index = indices.size();
+	stitch_patch_grids(grids, levels);
+
+	std::vector<sub_patch> sub_patches;
+	layout_patch_grids(grids, levels, sub_patches);
+
+	ThreadPool::shared().parallel_for((int)sub_patches.size(), 16, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+			tesselate(sub_patches[i]);
+	});
 }
 
 void BSPLoader::load_file()
@@ -484,11 +1438,11 @@ void BSPLoader::load_file()
 	// then read each of the data lumps in "order"
 	get_lump_position(0, offset, length);
 
-	file_entities.ents = new char[length];
+	file_entities.ents.resize(length);
 
 	PHYSFS_seek(handle, offset);
-	PHYSFS_readBytes(handle, file_entities.ents, length);
-	//fs.read(file_entities.ents, length);
+	if (length > 0)
+		PHYSFS_readBytes(handle, &file_entities.ents[0], length);
 
 	int lightmapCount = file_directory.direntries[14].length / sizeof(lightmap);
 
@@ -524,11 +1478,23 @@ void BSPLoader::load_file()
 	
 	PHYSFS_close(handle);
 
+	entity_store.build(file_entities.ents);
+	build_light_grid();
 	load_models();
 	build_indices();
+	weld_vertices(false);
+	optimize_indices(false);
 	tesselate_patches();
+	weld_vertices(true);
+	optimize_indices(true);
+	if (!scripts_loaded)
+	{
+		shader_scripts.load();
+		scripts_loaded = true;
+	}
 	process_textures();
-	process_lightmaps();	
+	process_lightmaps();
+	build_render_data();
 
 	loaded = true;
 }
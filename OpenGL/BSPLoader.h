@@ -2,6 +2,7 @@
 
 #include <string>
 #include <fstream>
+#include <map>
 #include <vector>
 #include <iostream>
 
@@ -9,7 +10,13 @@
 #include <glm\glm.hpp>
 
 #include "physfs/physfs.h"
+#include "EntityStore.h"
+#include "LightGrid.h"
 #include "MD3Loader.h"
+#include "Meshlet.h"
+#include "ModelCache.h"
+#include "ProgramCache.h"
+#include "ShaderParser.h"
 
 // Q3 BSP format reference: http://www.mralligator.com/q3/
 
@@ -76,7 +83,7 @@ struct visdata
 {
 	int n_vecs;
 	int sz_vecs;
-	std::vector<ubyte*> vecs;
+	std::vector<ubyte> vecs;	// n_vecs rows of sz_vecs bytes, one bit per cluster
 };
 
 struct lightvol
@@ -100,8 +107,8 @@ struct face
 	int texture;
 	int effect;
 	int type;
-	int vertex;
-	int n_vertexes;
+	int vertex;			// once loaded only patches (their control points) and billboards keep
+	int n_vertexes;		// a vertex range, other faces have 0 and go through their indices
 	int meshvert;
 	int n_meshverts;
 	int lm_index;
@@ -208,12 +215,13 @@ struct shader
 	bool render;
 
 	std::string name;
-	GLuint id;
+	GLuint id{ 0 };
+	int material{ -1 };	// the script's stages, -1 when the texture and lightmap pass draws it
 };
 
 struct entities
 {
-	char* ents;
+	std::string ents;
 };
 
 struct direntry
@@ -229,6 +237,173 @@ struct Directory
 	direntry direntries[17];
 };
 
+// a face as laid out in the render-only vertex/index buffers
+struct draw_surface
+{
+	int face;
+	int meshvert;	// first index in the render index buffer
+	int n_meshverts;
+	int first_meshlet;
+	int n_meshlets;
+	GLuint texture;
+	GLuint lightmap;
+	bool vertex_lit;	// lit by its vertex colours rather than a lightmap
+	int material;	// see shader
+};
+
+// one stage of a script, drawn as a pass of its own
+struct material_pass
+{
+	const Stage* stage;
+	stage_key key;
+	bool lightmap;	// draws the surface's lightmap rather than a texture
+	std::vector<GLuint> frames;	// one texture, or an animMap's frames
+};
+
+// a shader script the single texture and lightmap pass can't draw. its surfaces are sorted by
+// lightmap, so a pass that needs one binds each only once.
+struct material
+{
+	std::string name;
+	std::vector<material_pass> passes;
+	bool blended;	// the first pass blends, so it goes after everything opaque
+	bool two_sided;
+	std::vector<int> surfaces;	// draw surfaces
+};
+
+struct cache_stats
+{
+	float acmr_before{ 0 };
+	float acmr_after{ 0 };
+	int triangles{ 0 };
+};
+
+// where the tessellated patches start in a vertex/index set, they run to the end of it
+struct patch_range
+{
+	int first_vertex{ 0 };
+	int first_index{ 0 };
+};
+
+// how finely bezier patches get subdivided. each 3x3 patch is split until its flattened
+// curves are within max_error world units of the real ones, much like q3's r_subdivisions.
+struct tessellation_settings
+{
+	float max_error{ 4.f };
+	int min_level{ 1 };
+	int max_level{ 10 };
+};
+
+// a patch face tessellated as one grid of vertices, u major
+struct patch_grid
+{
+	int face;
+	int dimX;			// 3x3 sub-patches along u
+	int dimY;			// and along v
+	int level_offset;	// dimX u levels then dimY v levels in the level list
+	int width;			// grid vertices along u
+	int height;			// and along v
+	int vOffset;
+	int iOffset;
+};
+
+// a 3x3 block of a patch face and where its tessellated output goes in the face grid
+struct sub_patch
+{
+	int control;	// first control point
+	int width;		// control points per row of the face
+	int levelU;
+	int levelV;
+	int rows;		// grid rows and columns written, the far ones are shared with the
+	int cols;		// next sub-patch along and only written on the edge of the face
+	int gridU;		// first grid row and column
+	int gridV;
+	int stride;		// grid vertices per row
+	int vOffset;	// first vertex and index of the face grid
+	int iOffset;
+};
+
+// simd bezier kernel against the scalar reference path, rates are vertices per second
+struct tessellation_benchmark
+{
+	int vertices{ 0 };
+	double reference_rate{ 0 };
+	double kernel_rate{ 0 };
+	float max_error{ 0 };	// relative to the largest control value of the same kind
+	int colour_error{ 0 };
+	int mismatches{ 0 };	// vertices that aren't bit identical
+	int asymmetric{ 0 };	// vertices that change when a patch's control rows are reversed
+	bool passed{ false };	// errors within tolerance and every patch symmetric
+};
+
+// simd md3 frame blending against the scalar reference path, rates are vertices per second
+struct animation_benchmark
+{
+	int vertices{ 0 };
+	double reference_rate{ 0 };
+	double kernel_rate{ 0 };
+	float max_error{ 0 };
+	bool passed{ false };	// max_error within tolerance
+};
+
+// tolerances for merging vertices, 0 only merges exact duplicates.
+struct weld_settings
+{
+	float position_epsilon{ 0.f };
+	float texcoord_epsilon{ 0.f };
+	float normal_epsilon{ 0.f };
+};
+
+struct weld_stats
+{
+	int groups{ 0 };
+	int vertices_before{ 0 };
+	int vertices_after{ 0 };
+};
+
+// md3 vertices are kept in model space and shared by every placement of the model,
+// so they only need what the model shader uses
+struct model_vertex
+{
+	glm::vec3 position;
+	glm::vec2 texcoord;
+	glm::vec3 normal;
+};
+
+// an md3 surface in the model buffers, its indices already point at the model vertices
+struct model_surface
+{
+	int first_index;
+	int n_indices;
+	int texture;
+};
+
+// the surfaces of one level of detail of a mesh
+struct model_lod
+{
+	int first_surface;
+	int n_surfaces;
+	int n_triangles;
+};
+
+// one md3 file, stored once however many misc_models use it
+struct model_mesh
+{
+	std::string name;
+	const Model* model;		// the full detail model, shared with the model cache
+	model_lod lods[MaxModelLods];	// lods[0] is the model itself, then the _1 and _2 versions
+	int lod_count;
+	float radius;			// of the first frame, for picking the level of detail
+};
+
+// a misc_model: the mesh, where it sits in the map and the light grid at its origin
+struct model_instance
+{
+	int mesh;
+	glm::mat4 transform;
+	light_sample light;
+};
+
 #pragma endregion
 
 class BSPLoader
@@ -247,33 +422,95 @@ public:
 		load_file();
 	}
 
-	std::vector<vertex> get_vertex_data() const { return file_vertices; }
+	// full vertex/index set, kept on the cpu for collision and tools
+	const std::vector<vertex>& get_vertex_data() const { return file_vertices; }
 	face get_face(int index) const { return file_faces[index]; }
 	shader get_shader(int index) const { return shaders[index]; }
 	GLuint get_lightmap_tex(int index) const { return lightmaps[index].id; }
 	GLuint get_default_lightmap() const { return (GLuint)file_lightmaps.size(); }
 	int get_face_count() const { return (int)file_faces.size(); }
-	std::vector<unsigned int> get_indices();
+	const std::vector<unsigned int>& get_indices() const { return indices; }
+	// only the geometry that gets drawn, this is what goes to the gpu
+	const std::vector<vertex>& get_render_vertices() const { return render_vertices; }
+	const std::vector<unsigned int>& get_render_indices() const { return render_indices; }
+	const std::vector<draw_surface>& get_draw_surfaces() const { return draw_surfaces; }
+	const MeshletSet& get_meshlets() const { return meshlets; }
+	const std::vector<material>& get_materials() const { return materials; }
+	// opaque materials then blended ones, each group sorted by the key of its first pass so
+	// materials sharing a program draw one after the other
+	const std::vector<int>& get_material_order() const { return material_order; }
 	meshvert get_meshvert(int index) const { return file_meshverts[index]; }
+	// collision data, as read from the file
+	const std::vector<plane>& get_planes() const { return file_planes; }
+	const std::vector<node>& get_nodes() const { return file_nodes; }
+	const std::vector<leaf>& get_leafs() const { return file_leafs; }
+	const std::vector<leafbrush>& get_leafbrushes() const { return file_leafbrushes; }
+	const std::vector<brush>& get_brushes() const { return file_brushes; }
+	const std::vector<brushside>& get_brushsides() const { return file_brushsides; }
+	const std::vector<texture>& get_textures() const { return file_textures; }
+	const std::vector<model>& get_models() const { return file_models; }
+	const visdata& get_visdata() const { return file_visdata; }
+	const LightGrid& get_light_grid() const { return light_grid; }
+	// misc_models, drawn instanced rather than merged into the map geometry
+	const std::vector<model_vertex>& get_model_vertices() const { return model_vertices; }
+	const std::vector<unsigned int>& get_model_indices() const { return model_indices; }
+	const std::vector<model_mesh>& get_model_meshes() const { return model_meshes; }
+	const std::vector<model_surface>& get_model_surfaces() const { return model_surfaces; }
+	const std::vector<model_instance>& get_model_instances() const { return model_instances; }
+	// parsed md3s, kept across map loads
+	model_cache_stats get_model_cache_stats() const { return model_cache.get_stats(); }
+	// the parsed entity lump
+	const EntityStore& get_entities() const { return entity_store; }
+	// the shader scripts are indexed by the first map load and kept for the ones after. new
+	// data can bring new scripts, so they're indexed again with the next map after this.
+	void reload_shader_scripts() { scripts_loaded = false; }
 	GLuint get_lm_id() const { return lmap_id; }
+	// patches sit at the end of the render set, changing the tessellation only rewrites that part
+	patch_range get_render_patch_range() const { return render_patch_region; }
+	cache_stats get_cache_stats() const;
+	weld_stats get_weld_stats() const;
+	weld_settings get_weld_settings() const { return weld_config; }
+	// used from the next map load on
+	void set_weld_settings(weld_settings settings) { weld_config = settings; }
+	tessellation_settings get_tessellation_settings() const { return tessellation_config; }
+	// re-tessellates the patches straight away if a map is loaded
+	void set_tessellation_settings(tessellation_settings settings);
+	tessellation_benchmark benchmark_tessellation(int repeats) const;
+	// blends every surface of this map's models half way from their first frame to their last
+	animation_benchmark benchmark_animation(int repeats) const;
 
 	bool is_loaded() const { return loaded; }
 private:
 	void get_lump_position(int index, int& offset, int& length);
 
 	void build_indices();
+	void weld_vertices(bool patches);
+	void optimize_indices(bool patches);
 
 	void process_textures();
+	int build_material(const Shader& script);
+	GLuint load_stage_texture(const std::string& name, bool clamp);
+	void group_material_surfaces();
 	void process_lightmaps();
 
 	void combine_lightmaps();
-	void update_lm_coords();
+	void update_lm_coords(int first_vertex = 0);
+
+	void build_render_data();
+	void append_render_faces(bool patches);
+	void rebuild_patches();
 
 	void clear_memory();
 
-	void tesselate(int controlOffset, int controlWidth, int vOffset, int iOffset);
+	void patch_levels(int controlOffset, int controlWidth, int& levelU, int& levelV) const;
+	void build_patch_grids(std::vector<patch_grid>& grids, std::vector<int>& levels) const;
+	int stitch_patch_grids(const std::vector<patch_grid>& grids, std::vector<int>& levels) const;
+	void layout_patch_grids(std::vector<patch_grid>& grids, const std::vector<int>& levels, std::vector<sub_patch>& sub_patches);
+	void tesselate(const sub_patch& patch);
 	void tesselate_patches();
+	void build_light_grid();
 	void load_models();
+	int load_model_mesh(const std::string& name, std::map<std::string, int>& texture_lookup);
 
 	GLuint lmap_id;
 	std::vector<LightMap> lightmaps;
@@ -292,6 +529,24 @@ private:
 
 	std::vector<unsigned int> indices;
 
+	std::vector<vertex> render_vertices;
+	std::vector<unsigned int> render_indices;
+	std::vector<draw_surface> draw_surfaces;
+	MeshletSet meshlets;
+	LightGrid light_grid;
+
+	patch_range patch_region;
+	patch_range render_patch_region;
+	int static_surface_count{ 0 };
+	int static_meshlet_count{ 0 };
+
+	cache_stats static_cache;
+	cache_stats patch_cache;
+	tessellation_settings tessellation_config;
+	weld_settings weld_config;
+	weld_stats static_weld;
+	weld_stats patch_weld;
+
 	Directory file_directory;
 	entities file_entities;
 	int texture_count;
@@ -311,8 +566,19 @@ private:
 	std::vector < lightmap > file_lightmaps;
 	std::vector < lightvol > file_lightvols;
 	visdata file_visdata;
-
-	std::vector<Model> models;
+	EntityStore entity_store;
+	ShaderParser shader_scripts;
+	bool scripts_loaded{ false };
+	std::vector<material> materials;
+	std::vector<int> material_order;
+	std::map<std::string, GLuint> stage_textures;	// by image name, shared between materials
+
+	ModelCache model_cache;
+	std::vector<model_vertex> model_vertices;
+	std::vector<unsigned int> model_indices;
+	std::vector<model_mesh> model_meshes;
+	std::vector<model_surface> model_surfaces;
+	std::vector<model_instance> model_instances;
 };
 
 // generic function to read lumps that are sizeof/length style.
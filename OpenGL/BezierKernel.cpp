@@ -0,0 +1,280 @@
+#include "BezierKernel.h"
+
+#include <algorithm>
+
+#include "Simd.h"
+
+// a vertex spread out into float channels: position, texcoord, lightmap coord, normal, colour
+const int Channels = 16;
+const int UsedChannels = 14;
+const int ColourChannel = 10;
+
+// room for the widest row, rounded up to whole simd registers
+const int MaxRow = (MaxBezierLevel + 1 + 3) & ~3;
+
+struct basis
+{
+	alignas(16) float w0[MaxRow];
+	alignas(16) float w1[MaxRow];
+	alignas(16) float w2[MaxRow];
+};
+
+// quadratic basis weights (b^2, 2ab, a^2) at a = i / level. the second half mirrors the
+// first, and the kernel sums the two end terms before the middle one, so a curve evaluated
+// from either end gives bit identical points.
+static constexpr void fill_basis(basis& table, int level)
+{
+	for (int i = 0; i < MaxRow; ++i)
+	{
+		table.w0[i] = 0.f;
+		table.w1[i] = 0.f;
+		table.w2[i] = 0.f;
+	}
+
+	for (int i = 0; i <= level; ++i)
+	{
+		int m = i <= level - i ? i : level - i;
+		float a = (float)m / level;
+		float b = 1.f - a;
+
+		float near_end = b * b;
+		float middle = 2.f * b * a;
+		float far_end = a * a;
+
+		table.w0[i] = i == m ? near_end : far_end;
+		table.w1[i] = middle;
+		table.w2[i] = i == m ? far_end : near_end;
+	}
+}
+
+template<int Level>
+struct fixed_basis
+{
+	basis table;
+
+	constexpr fixed_basis() : table()
+	{
+		fill_basis(table, Level);
+	}
+};
+
+// tables for the common levels are built at compile time
+template<int Level>
+constexpr fixed_basis<Level> fixed_basis_table{};
+
+static void to_channels(const vertex& v, float* out)
+{
+	out[0] = v.position.x;
+	out[1] = v.position.y;
+	out[2] = v.position.z;
+	out[3] = v.dtexcoord.x;
+	out[4] = v.dtexcoord.y;
+	out[5] = v.lmtexcoord.x;
+	out[6] = v.lmtexcoord.y;
+	out[7] = v.normal.x;
+	out[8] = v.normal.y;
+	out[9] = v.normal.z;
+	for (int c = 0; c < 4; ++c)
+		out[ColourChannel + c] = v.colour[c];
+	out[14] = 0.f;
+	out[15] = 0.f;
+}
+
+static ubyte to_colour(float value)
+{
+	return (ubyte)std::min(std::max(value + 0.5f, 0.f), 255.f);
+}
+
+// Level is the v level the row loop is specialised for, 0 for any level
+template<int Level>
+static void evaluate_rows(const float control[9][Channels], const basis& u, const basis& v, int levelV,
+	int rows, int cols, vertex* out, int row_stride)
+{
+	const int width = Level > 0 ? ((Level + 1 + 3) & ~3) : ((levelV + 1 + 3) & ~3);
+
+	alignas(16) float temp[3][Channels];
+	alignas(16) float row[UsedChannels][MaxRow];
+
+	for (int i = 0; i < rows; ++i)
+	{
+		// collapse the three control rows along u
+#if USE_SSE2
+		const __m128 u0 = _mm_set1_ps(u.w0[i]);
+		const __m128 u1 = _mm_set1_ps(u.w1[i]);
+		const __m128 u2 = _mm_set1_ps(u.w2[i]);
+
+		for (int k = 0; k < 3; ++k)
+		{
+			for (int c = 0; c < Channels; c += 4)
+			{
+				__m128 p = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_load_ps(&control[k * 3 + 0][c]), u0),
+					_mm_mul_ps(_mm_load_ps(&control[k * 3 + 2][c]), u2)),
+					_mm_mul_ps(_mm_load_ps(&control[k * 3 + 1][c]), u1));
+				_mm_store_ps(&temp[k][c], p);
+			}
+		}
+#else
+		for (int k = 0; k < 3; ++k)
+		{
+			for (int c = 0; c < Channels; ++c)
+			{
+				temp[k][c] = (control[k * 3 + 0][c] * u.w0[i] + control[k * 3 + 2][c] * u.w2[i]) + control[k * 3 + 1][c] * u.w1[i];
+			}
+		}
+#endif
+
+		// evaluate the whole row across v, one channel at a time and four points at once
+		for (int c = 0; c < UsedChannels; ++c)
+		{
+#if USE_SSE2
+			const __m128 t0 = _mm_set1_ps(temp[0][c]);
+			const __m128 t1 = _mm_set1_ps(temp[1][c]);
+			const __m128 t2 = _mm_set1_ps(temp[2][c]);
+
+			for (int j = 0; j < width; j += 4)
+			{
+				__m128 p = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(t0, _mm_load_ps(&v.w0[j])),
+					_mm_mul_ps(t2, _mm_load_ps(&v.w2[j]))),
+					_mm_mul_ps(t1, _mm_load_ps(&v.w1[j])));
+				_mm_store_ps(&row[c][j], p);
+			}
+#else
+			for (int j = 0; j < width; ++j)
+			{
+				row[c][j] = (temp[0][c] * v.w0[j] + temp[2][c] * v.w2[j]) + temp[1][c] * v.w1[j];
+			}
+#endif
+		}
+
+		vertex* dest = out + i * row_stride;
+		for (int j = 0; j < cols; ++j)
+		{
+			vertex& vert = dest[j];
+			vert.position = glm::vec3(row[0][j], row[1][j], row[2][j]);
+			vert.dtexcoord = glm::vec2(row[3][j], row[4][j]);
+			vert.lmtexcoord = glm::vec2(row[5][j], row[6][j]);
+			vert.normal = glm::vec3(row[7][j], row[8][j], row[9][j]);
+			for (int k = 0; k < 4; ++k)
+				vert.colour[k] = to_colour(row[ColourChannel + k][j]);
+		}
+	}
+}
+
+static const basis& basis_for(int level, basis& scratch)
+{
+	switch (level)
+	{
+	case 1: return fixed_basis_table<1>.table;
+	case 2: return fixed_basis_table<2>.table;
+	case 3: return fixed_basis_table<3>.table;
+	case 4: return fixed_basis_table<4>.table;
+	case 5: return fixed_basis_table<5>.table;
+	case 6: return fixed_basis_table<6>.table;
+	case 7: return fixed_basis_table<7>.table;
+	case 8: return fixed_basis_table<8>.table;
+	case 9: return fixed_basis_table<9>.table;
+	case 10: return fixed_basis_table<10>.table;
+	default:
+		fill_basis(scratch, level);
+		return scratch;
+	}
+}
+
+void BezierKernel::evaluate(const vertex* control, int control_width, int levelU, int levelV,
+	int rows, int cols, vertex* out, int row_stride)
+{
+	alignas(16) float controls[9][Channels];
+	for (int k = 0; k < 3; ++k)
+	{
+		for (int c = 0; c < 3; ++c)
+			to_channels(control[k * control_width + c], controls[k * 3 + c]);
+	}
+
+	basis u_scratch, v_scratch;
+	const basis& u = basis_for(levelU, u_scratch);
+	const basis& v = basis_for(levelV, v_scratch);
+
+	switch (levelV)
+	{
+	case 1: evaluate_rows<1>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 2: evaluate_rows<2>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 3: evaluate_rows<3>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 4: evaluate_rows<4>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 5: evaluate_rows<5>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 6: evaluate_rows<6>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 7: evaluate_rows<7>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 8: evaluate_rows<8>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 9: evaluate_rows<9>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	case 10: evaluate_rows<10>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	default: evaluate_rows<0>(controls, u, v, levelV, rows, cols, out, row_stride); break;
+	}
+}
+
+// the vertex arithmetic patches were tessellated with before the kernel, colour aside
+static vertex operator+(const vertex& v1, const vertex& v2)
+{
+	return vertex{ 
+		v1.position + v2.position,	   
+		v1.dtexcoord + v2.dtexcoord,	   
+		v1.lmtexcoord + v2.lmtexcoord,	   
+		v1.normal + v2.normal
+	};
+}
+
+static vertex operator*(const vertex& v1, const float& d)
+{
+	return vertex{ 
+		v1.position * d, 
+		v1.dtexcoord * d, 
+		v1.lmtexcoord * d, 
+		v1.normal * d 
+	};
+}
+
+void BezierKernel::evaluate_reference(const vertex* control, int control_width, int levelU, int levelV,
+	int rows, int cols, vertex* out, int row_stride)
+{
+	vertex controls[9];
+	float colours[9][4];
+	int cIndex = 0;
+	for (int c = 0; c < 3; ++c)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			controls[cIndex] = control[c * control_width + k];
+			for (int n = 0; n < 4; ++n)
+				colours[cIndex][n] = controls[cIndex].colour[n];
+			cIndex++;
+		}
+	}
+
+	for (int i = 0; i < rows; ++i)
+	{
+		float a = (float)i / levelU;
+		float b = 1.f - a;
+
+		vertex temp[3];
+		float temp_colour[3][4];
+
+		for (int j = 0; j < 3; ++j)
+		{
+			int k = 3 * j;
+			temp[j] = controls[k + 0] * b * b + controls[k + 1] * 2 * b * a + controls[k + 2] * a * a;
+			for (int n = 0; n < 4; ++n)
+				temp_colour[j][n] = colours[k + 0][n] * b * b + colours[k + 1][n] * 2 * b * a + colours[k + 2][n] * a * a;
+		}
+
+		for (int j = 0; j < cols; ++j)
+		{
+			float a = (float)j / levelV;
+			float b = 1.f - a;
+
+			vertex& vert = out[i * row_stride + j];
+			vert = temp[0] * b * b + temp[1] * 2 * b * a + temp[2] * a * a;
+			for (int n = 0; n < 4; ++n)
+				vert.colour[n] = to_colour(temp_colour[0][n] * b * b + temp_colour[1][n] * 2 * b * a + temp_colour[2][n] * a * a);
+		}
+	}
+}
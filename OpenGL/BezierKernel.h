@@ -0,0 +1,22 @@
+#pragma once
+
+#include "BSPLoader.h"
+
+// highest subdivision level the kernel handles along either direction of a 3x3 patch
+const int MaxBezierLevel = 64;
+
+// evaluates quadratic 3x3 bezier patches. the control points are the 3x3 block starting
+// at control, with rows control_width vertices apart, u running along a row.
+// out[i * row_stride + j] receives the point at u = i / levelU, v = j / levelV for the
+// first rows x cols points, so a caller can leave out a shared last row or column.
+class BezierKernel
+{
+public:
+	// soa simd path with precomputed basis weights, specialised for levels up to 10
+	static void evaluate(const vertex* control, int control_width, int levelU, int levelV,
+		int rows, int cols, vertex* out, int row_stride);
+
+	// the scalar vertex arithmetic patches used before the kernel, kept to check it against
+	static void evaluate_reference(const vertex* control, int control_width, int levelU, int levelV,
+		int rows, int cols, vertex* out, int row_stride);
+};
@@ -0,0 +1,448 @@
+#include "CollisionModel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "Simd.h"
+
+// keeps traces this far off the surfaces they hit, so the next one doesn't start inside
+const float SurfaceClipEpsilon = 0.125f;
+
+// per-thread stamps so a brush sitting in several leafs is only clipped once per trace
+struct brush_stamps
+{
+	unsigned int generation{ 0 };
+	unsigned int count{ 0 };
+	std::vector<unsigned int> stamps;
+};
+
+static thread_local brush_stamps thread_stamps;
+
+struct CollisionModel::trace_work
+{
+	glm::vec3 start;
+	glm::vec3 end;
+	glm::vec3 offsets[8];	// box corners, indexed by a plane's signbits
+	glm::vec3 extents;
+	bool is_point;
+	int contents;
+
+	unsigned int* stamps;
+	unsigned int stamp;
+
+	trace_result result;
+};
+
+void CollisionModel::clear()
+{
+	planes.clear();
+	nodes.clear();
+	leafs.clear();
+	leaf_brushes.clear();
+	brushes.clear();
+	sides.clear();
+	models.clear();
+	vis.clear();
+	vis_clusters = 0;
+	vis_row = 0;
+}
+
+void CollisionModel::build(const BSPLoader& loader)
+{
+	static std::atomic<unsigned int> generations{ 0 };
+
+	clear();
+	generation = ++generations;
+
+	for (auto& p : loader.get_planes())
+	{
+		cm_plane _plane;
+		_plane.normal = glm::vec3(p.normal[0], p.normal[1], p.normal[2]);
+		_plane.dist = p.dist;
+		_plane.type = 3;
+		_plane.signbits = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			if (_plane.normal[k] == 1.f) _plane.type = k;
+			if (_plane.normal[k] < 0.f) _plane.signbits |= 1 << k;
+		}
+		planes.push_back(_plane);
+	}
+
+	for (auto& n : loader.get_nodes())
+	{
+		const cm_plane& _plane = planes[n.plane];
+		nodes.push_back(cm_node{ _plane.normal, _plane.dist, n.plane, { n.children[0], n.children[1] } });
+	}
+
+	for (auto& l : loader.get_leafs())
+		leafs.push_back(cm_leaf{ l.leafbrush, l.n_leafbrushes, l.cluster, l.area });
+
+	for (auto& lb : loader.get_leafbrushes())
+		leaf_brushes.push_back(lb.brush);
+
+	const std::vector<texture>& textures = loader.get_textures();
+
+	for (auto& b : loader.get_brushes())
+		brushes.push_back(cm_brush{ b.brushside, b.n_brushsides, textures[b.texture].contents });
+
+	for (auto& s : loader.get_brushsides())
+		sides.push_back(cm_side{ s.plane, textures[s.texture].flags });
+
+	for (auto& m : loader.get_models())
+		models.push_back(cm_model{ m.brush, m.n_brushes });
+
+	const visdata& _visdata = loader.get_visdata();
+	if (_visdata.n_vecs > 0 && _visdata.vecs.size() >= (size_t)_visdata.n_vecs * _visdata.sz_vecs)
+	{
+		vis = _visdata.vecs;
+		vis_clusters = _visdata.n_vecs;
+		vis_row = _visdata.sz_vecs;
+	}
+}
+
+trace_result CollisionModel::trace(const glm::vec3& start, const glm::vec3& end, const glm::vec3& mins, const glm::vec3& maxs,
+	int contentmask, int model) const
+{
+	trace_work work;
+	work.contents = contentmask;
+	work.result.end = end;
+
+	if (nodes.empty() || model < 0 || model >= (int)models.size()) return work.result;
+
+	brush_stamps& local = thread_stamps;
+	if (local.generation != generation || local.stamps.size() != brushes.size())
+	{
+		local.generation = generation;
+		local.count = 0;
+		local.stamps.assign(brushes.size(), 0);
+	}
+	if (++local.count == 0)
+	{
+		std::fill(local.stamps.begin(), local.stamps.end(), 0);
+		local.count = 1;
+	}
+	work.stamps = local.stamps.data();
+	work.stamp = local.count;
+
+	// trace the centre of the box, with a symmetric size around it
+	glm::vec3 offset = (mins + maxs) * 0.5f;
+	glm::vec3 size[2] = { mins - offset, maxs - offset };
+	work.start = start + offset;
+	work.end = end + offset;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+			work.offsets[i][k] = size[(i >> k) & 1][k];
+	}
+
+	work.extents = size[1];
+	work.is_point = size[1] == glm::vec3(0.f);
+
+	if (model == 0)
+		trace_tree(work, 0, 0.f, 1.f, work.start, work.end);
+	else
+	{
+		// inline models don't have a tree of their own, their brushes act as one leaf
+		const cm_model& _model = models[model];
+		for (int i = 0; i < _model.n_brushes; ++i)
+			trace_brush(work, _model.first_brush + i);
+	}
+
+	trace_result& result = work.result;
+	if (result.fraction == 1.f)
+		result.end = end;
+	else
+		result.end = start + result.fraction * (end - start);
+
+	return result;
+}
+
+void CollisionModel::trace_tree(trace_work& work, int num, float p1f, float p2f, const glm::vec3& p1, const glm::vec3& p2) const
+{
+	// already hit something closer than this part of the sweep
+	if (work.result.fraction <= p1f) return;
+
+	if (num < 0)
+	{
+		trace_leaf(work, leafs[-1 - num]);
+		return;
+	}
+
+	const cm_node& _node = nodes[num];
+	const cm_plane& _plane = planes[_node.plane];
+
+	float t1, t2, offset;
+	if (_plane.type < 3)
+	{
+		t1 = p1[_plane.type] - _plane.dist;
+		t2 = p2[_plane.type] - _plane.dist;
+		offset = work.extents[_plane.type];
+	}
+	else
+	{
+		t1 = glm::dot(_plane.normal, p1) - _plane.dist;
+		t2 = glm::dot(_plane.normal, p2) - _plane.dist;
+		// like CM_TraceThroughTree, a box against a slanted plane goes down both sides unless
+		// it's far away. the brushes clip it exactly at the leaves.
+		offset = work.is_point ? 0.f : 2048.f;
+	}
+
+	// the whole box stays on one side
+	if (t1 >= offset + 1 && t2 >= offset + 1)
+	{
+		trace_tree(work, _node.children[0], p1f, p2f, p1, p2);
+		return;
+	}
+	if (t1 < -offset - 1 && t2 < -offset - 1)
+	{
+		trace_tree(work, _node.children[1], p1f, p2f, p1, p2);
+		return;
+	}
+
+	// split the sweep where it crosses, each half overlapping the plane by the box size
+	int side;
+	float frac, frac2;
+	if (t1 < t2)
+	{
+		float idist = 1.f / (t1 - t2);
+		side = 1;
+		frac2 = (t1 + offset + SurfaceClipEpsilon) * idist;
+		frac = (t1 - offset + SurfaceClipEpsilon) * idist;
+	}
+	else if (t1 > t2)
+	{
+		float idist = 1.f / (t1 - t2);
+		side = 0;
+		frac2 = (t1 - offset - SurfaceClipEpsilon) * idist;
+		frac = (t1 + offset + SurfaceClipEpsilon) * idist;
+	}
+	else
+	{
+		side = 0;
+		frac = 1.f;
+		frac2 = 0.f;
+	}
+
+	frac = std::min(std::max(frac, 0.f), 1.f);
+	frac2 = std::min(std::max(frac2, 0.f), 1.f);
+
+	float midf = p1f + (p2f - p1f) * frac;
+	glm::vec3 mid = p1 + frac * (p2 - p1);
+	trace_tree(work, _node.children[side], p1f, midf, p1, mid);
+
+	midf = p1f + (p2f - p1f) * frac2;
+	mid = p1 + frac2 * (p2 - p1);
+	trace_tree(work, _node.children[side ^ 1], midf, p2f, mid, p2);
+}
+
+void CollisionModel::trace_leaf(trace_work& work, const cm_leaf& leaf) const
+{
+	for (int i = 0; i < leaf.n_brushes; ++i)
+	{
+		int b = leaf_brushes[leaf.first_brush + i];
+
+		// brushes can be in more than one leaf
+		if (work.stamps[b] == work.stamp) continue;
+		work.stamps[b] = work.stamp;
+
+		trace_brush(work, b);
+
+		if (work.result.all_solid) return;
+	}
+}
+
+void CollisionModel::trace_brush(trace_work& work, int b) const
+{
+	const cm_brush& _brush = brushes[b];
+	if (_brush.n_sides == 0 || !(_brush.contents & work.contents)) return;
+
+	float enter = -1.f;
+	float leave = 1.f;
+	const cm_plane* clip_plane = nullptr;
+	const cm_side* lead_side = nullptr;
+	bool get_out = false;
+	bool start_out = false;
+
+	// compare the box against every side, pushed out by the box corner nearest to it
+	for (int i = 0; i < _brush.n_sides; ++i)
+	{
+		const cm_side& _side = sides[_brush.first_side + i];
+		const cm_plane& _plane = planes[_side.plane];
+
+		float dist = _plane.dist - glm::dot(work.offsets[_plane.signbits], _plane.normal);
+		float d1 = glm::dot(work.start, _plane.normal) - dist;
+		float d2 = glm::dot(work.end, _plane.normal) - dist;
+
+		if (d2 > 0) get_out = true;
+		if (d1 > 0) start_out = true;
+
+		// entirely in front of this side, so it can't touch the brush
+		if (d1 > 0 && (d2 >= SurfaceClipEpsilon || d2 >= d1)) return;
+
+		// entirely behind it, some other side will clip
+		if (d1 <= 0 && d2 <= 0) continue;
+
+		if (d1 > d2)
+		{
+			// entering the brush through this side
+			float f = std::max((d1 - SurfaceClipEpsilon) / (d1 - d2), 0.f);
+			if (f > enter)
+			{
+				enter = f;
+				clip_plane = &_plane;
+				lead_side = &_side;
+			}
+		}
+		else
+		{
+			float f = std::min((d1 + SurfaceClipEpsilon) / (d1 - d2), 1.f);
+			if (f < leave) leave = f;
+		}
+	}
+
+	trace_result& result = work.result;
+
+	if (!start_out)
+	{
+		result.start_solid = true;
+		if (!get_out)
+		{
+			result.all_solid = true;
+			result.fraction = 0.f;
+			result.contents = _brush.contents;
+		}
+		return;
+	}
+
+	if (enter < leave && enter > -1 && enter < result.fraction)
+	{
+		result.fraction = std::max(enter, 0.f);
+		result.normal = clip_plane->normal;
+		result.dist = clip_plane->dist;
+		result.surface_flags = lead_side->surface_flags;
+		result.contents = _brush.contents;
+	}
+}
+
+int CollisionModel::point_leaf(const glm::vec3& point) const
+{
+	int leaf;
+	point_leafs(&point, 1, &leaf);
+	return leaf;
+}
+
+int CollisionModel::point_contents(const glm::vec3& point) const
+{
+	int contents;
+	point_contents(&point, 1, &contents);
+	return contents;
+}
+
+void CollisionModel::point_leafs(const glm::vec3* points, int count, int* leafs_out) const
+{
+	if (nodes.empty())
+	{
+		std::fill(leafs_out, leafs_out + count, 0);
+		return;
+	}
+
+	int i = 0;
+
+#if USE_SSE2
+	// four points walk down together, each lane on its own node. the planes are gathered
+	// a lane at a time, the side tests are done at once. lanes that reach a leaf sit on a
+	// dummy plane until the slowest one gets there.
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128 px = _mm_set_ps(points[i + 3].x, points[i + 2].x, points[i + 1].x, points[i].x);
+		const __m128 py = _mm_set_ps(points[i + 3].y, points[i + 2].y, points[i + 1].y, points[i].y);
+		const __m128 pz = _mm_set_ps(points[i + 3].z, points[i + 2].z, points[i + 1].z, points[i].z);
+
+		int num[4] = { 0, 0, 0, 0 };
+		const cm_node* n[4];
+
+		while ((num[0] & num[1] & num[2] & num[3]) >= 0)
+		{
+			static const cm_node done{ glm::vec3(0.f), 0.f, 0, { 0, 0 } };
+			for (int k = 0; k < 4; ++k)
+				n[k] = num[k] >= 0 ? &nodes[num[k]] : &done;
+
+			__m128 d = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(px, _mm_set_ps(n[3]->normal.x, n[2]->normal.x, n[1]->normal.x, n[0]->normal.x)),
+				_mm_mul_ps(py, _mm_set_ps(n[3]->normal.y, n[2]->normal.y, n[1]->normal.y, n[0]->normal.y))),
+				_mm_mul_ps(pz, _mm_set_ps(n[3]->normal.z, n[2]->normal.z, n[1]->normal.z, n[0]->normal.z)));
+			int back = _mm_movemask_ps(_mm_cmplt_ps(d, _mm_set_ps(n[3]->dist, n[2]->dist, n[1]->dist, n[0]->dist)));
+
+			for (int k = 0; k < 4; ++k)
+			{
+				if (num[k] >= 0)
+					num[k] = n[k]->children[(back >> k) & 1];
+			}
+		}
+
+		for (int k = 0; k < 4; ++k)
+			leafs_out[i + k] = -1 - num[k];
+	}
+#endif
+
+	for (; i < count; ++i)
+	{
+		int num = 0;
+		while (num >= 0)
+		{
+			const cm_node& _node = nodes[num];
+			num = _node.children[glm::dot(_node.normal, points[i]) < _node.dist ? 1 : 0];
+		}
+		leafs_out[i] = -1 - num;
+	}
+}
+
+int CollisionModel::leaf_contents(const cm_leaf& leaf, const glm::vec3& point) const
+{
+	int contents = 0;
+
+	for (int i = 0; i < leaf.n_brushes; ++i)
+	{
+		const cm_brush& _brush = brushes[leaf_brushes[leaf.first_brush + i]];
+
+		// skip brushes that can't add anything new
+		if ((contents | _brush.contents) == contents) continue;
+
+		int side = 0;
+		for (; side < _brush.n_sides; ++side)
+		{
+			const cm_plane& _plane = planes[sides[_brush.first_side + side].plane];
+			if (glm::dot(point, _plane.normal) > _plane.dist) break;
+		}
+
+		if (side == _brush.n_sides)
+			contents |= _brush.contents;
+	}
+
+	return contents;
+}
+
+void CollisionModel::point_contents(const glm::vec3* points, int count, int* contents_out) const
+{
+	if (nodes.empty())
+	{
+		std::fill(contents_out, contents_out + count, 0);
+		return;
+	}
+
+	// leafs in batches small enough to stay on the stack, then the brushes point by point
+	const int Batch = 64;
+	int leaf_batch[Batch];
+
+	for (int first = 0; first < count; first += Batch)
+	{
+		int n = std::min(Batch, count - first);
+		point_leafs(points + first, n, leaf_batch);
+
+		for (int i = 0; i < n; ++i)
+			contents_out[first + i] = leaf_contents(leafs[leaf_batch[i]], points[first + i]);
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "BSPLoader.h"
+
+// result of sweeping a box (or a point, with zero mins and maxs) through the map
+struct trace_result
+{
+	bool all_solid{ false };	// the whole sweep was inside a brush
+	bool start_solid{ false };	// it started inside one
+	float fraction{ 1.f };		// 1 when nothing was hit
+	glm::vec3 end;				// where the box stopped
+	glm::vec3 normal{ 0.f };	// plane that was hit
+	float dist{ 0.f };
+	int surface_flags{ 0 };		// SURF_* of the brush side that was hit
+	int contents{ 0 };			// CONTENTS_* of the brush that was hit
+};
+
+// the brushes and bsp tree of a map, laid out for tracing against. q3's CM_BoxTrace:
+// the sweep walks down the tree, splitting where it crosses a plane, and is clipped
+// against the brushes in every leaf it reaches.
+class CollisionModel
+{
+public:
+	// copies what tracing needs out of a loaded map
+	void build(const BSPLoader& loader);
+	void clear();
+
+	// sweeps the box mins..maxs from start to end against brushes whose contents share a bit
+	// with contentmask. model 0 is the world, the others are inline brush models.
+	// safe to call from any number of threads at once and doesn't allocate, apart from
+	// the first trace on each thread.
+	trace_result trace(const glm::vec3& start, const glm::vec3& end, const glm::vec3& mins, const glm::vec3& maxs,
+		int contentmask, int model = 0) const;
+
+	// leaf each point falls in, walking the tree for four points at a time
+	void point_leafs(const glm::vec3* points, int count, int* leafs_out) const;
+	// CONTENTS_* of every world brush each point is inside, or 0 in open space
+	void point_contents(const glm::vec3* points, int count, int* contents_out) const;
+
+	int point_leaf(const glm::vec3& point) const;
+	int point_contents(const glm::vec3& point) const;
+
+	// whether anything in cluster to can be seen from cluster from, as far as the pvs says.
+	// -1 is outside the map and sees nothing, with no vis data everything is visible.
+	bool cluster_visible(int from, int to) const
+	{
+		if (from < 0 || to < 0) return false;
+		if (vis.empty() || from >= vis_clusters || to >= vis_clusters) return true;
+		return (vis[from * vis_row + (to >> 3)] & (1 << (to & 7))) != 0;
+	}
+
+	// visibility cluster (-1 outside the map) and area of a leaf
+	int leaf_cluster(int leaf) const { return leafs[leaf].cluster; }
+	int leaf_area(int leaf) const { return leafs[leaf].area; }
+
+	bool empty() const { return nodes.empty(); }
+
+private:
+	struct cm_plane
+	{
+		glm::vec3 normal;
+		float dist;
+		int type;		// 0-2 for planes facing down an axis, 3 otherwise
+		int signbits;	// bit set for each negative normal component
+	};
+
+	struct cm_node
+	{
+		glm::vec3 normal;	// copy of the plane, so a point query only touches the node
+		float dist;
+		int plane;
+		int children[2];	// negative for leafs, -1 - leaf index
+	};
+
+	struct cm_leaf
+	{
+		int first_brush;	// into leaf_brushes
+		int n_brushes;
+		int cluster;
+		int area;
+	};
+
+	struct cm_brush
+	{
+		int first_side;
+		int n_sides;
+		int contents;
+	};
+
+	struct cm_side
+	{
+		int plane;
+		int surface_flags;
+	};
+
+	struct cm_model
+	{
+		int first_brush;
+		int n_brushes;
+	};
+
+	struct trace_work;
+
+	void trace_tree(trace_work& work, int num, float p1f, float p2f, const glm::vec3& p1, const glm::vec3& p2) const;
+	void trace_leaf(trace_work& work, const cm_leaf& leaf) const;
+	void trace_brush(trace_work& work, int brush) const;
+	int leaf_contents(const cm_leaf& leaf, const glm::vec3& point) const;
+
+	std::vector<cm_plane> planes;
+	std::vector<cm_node> nodes;
+	std::vector<cm_leaf> leafs;
+	std::vector<int> leaf_brushes;
+	std::vector<cm_brush> brushes;
+	std::vector<cm_side> sides;
+	std::vector<cm_model> models;
+
+	std::vector<ubyte> vis;
+	int vis_clusters{ 0 };
+	int vis_row{ 0 };
+
+	// tells the per-thread brush stamps when they belong to a different map
+	unsigned int generation{ 0 };
+};
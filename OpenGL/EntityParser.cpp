@@ -1,90 +1,212 @@
 #include "EntityParser.h"
 
-#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 
-float entity::get_float(std::string key)
+// values are short, numbers get copied out so strtof has a terminated string to read
+static void terminated_copy(std::string_view value, char* buffer, size_t size)
 {
-    auto pair = pairs.find(key);
-    if(pair == pairs.end())
-        return 0.0f;
-
-    return std::atof(pair->second.c_str());
+    size_t length = value.size() < size - 1 ? value.size() : size - 1;
+    memcpy(buffer, value.data(), length);
+    buffer[length] = '\0';
 }
 
-std::string entity::get_string(std::string key)
+std::string_view entity::find(std::string_view key, bool& found) const
 {
-    auto pair = pairs.find(key);
-    if (pair == pairs.end())
-        return "";
-
-    return pair->second;
+    for (int i = 0; i < n_pairs; ++i)
+    {
+        if (pairs[i].key == key)
+        {
+            found = true;
+            return pairs[i].value;
+        }
+    }
+
+    found = false;
+    return std::string_view();
 }
 
-void entity::get_vec3(std::string key, glm::vec3& vec)
+bool entity::has(std::string_view key) const
 {
-    auto pair = pairs.find(key);
-    if (pair == pairs.end())
-        return;
-
-    std::string val = pair->second;
+    bool found;
+    find(key, found);
+    return found;
+}
 
-    double v1, v2, v3;
-    v1 = v2 = v3 = 0;
-    sscanf_s(val.c_str(), "%lf %lf %lf", &v1, &v2, &v3);
-    vec.x = v1;
-    vec.y = v2;
-    vec.z = v3;
+float entity::get_float(std::string_view key) const
+{
+    bool found;
+    std::string_view value = find(key, found);
+    if (!found)
+        return 0.0f;
 
+    char buffer[64];
+    terminated_copy(value, buffer, sizeof(buffer));
+    return strtof(buffer, nullptr);
 }
 
-entity EntityParser::parse(std::string ent)
+std::string_view entity::get_string(std::string_view key) const
 {
-    entity new_ent;
-
-    std::string line;
-    std::stringstream entdata;
-    entdata << ent;
+    bool found;
+    return find(key, found);
+}
 
-    entdata >> line;
+void entity::get_vec3(std::string_view key, glm::vec3& vec) const
+{
+    bool found;
+    std::string_view value = find(key, found);
+    if (!found)
+        return;
 
-    if (line != "{")
-        return new_ent;
+    // like sscanf, reading stops at the first component that isn't a number and the rest
+    // keep whatever they were
+    char buffer[128];
+    terminated_copy(value, buffer, sizeof(buffer));
 
-    do
+    char* next = buffer;
+    for (int i = 0; i < 3; ++i)
     {
-        std::string key;
-        std::string value;
-
-        std::getline(entdata, line);
-        if (line == "}") break;
-        if (line.size() == 0) continue;
-
-        int split = line.find(' ');
-        key = line.substr(0, split);
-        value = line.substr(split + 1, line.size() - 1);
-
-        key = key.substr(1, key.size() - 2);
-        value = value.substr(1, value.size() - 2);
-        new_ent.pairs.insert(std::pair<std::string, std::string>(key, value));
-
-    } while (true);
+        char* end;
+        float component = strtof(next, &end);
+        if (end == next)
+            break;
+        vec[i] = component;
+        next = end;
+    }
+}
 
-    return new_ent;
+namespace
+{
+    // walks the lump once, handing out views of each token
+    struct tokenizer
+    {
+        std::string_view text;
+        size_t pos{ 0 };
+
+        // the next token, or false at the end of the text. braces outside quotes are tokens
+        // of their own, and quoted is set for a quoted string so "}" isn't taken as a brace.
+        bool next(std::string_view& token, bool& quoted)
+        {
+            skip_space();
+            if (pos >= text.size())
+                return false;
+
+            quoted = text[pos] == '"';
+            if (quoted)
+            {
+                size_t close = text.find('"', pos + 1);
+                if (close == std::string_view::npos)
+                {
+                    // unterminated, let it run to the end
+                    token = text.substr(pos + 1);
+                    pos = text.size();
+                    return true;
+                }
+                token = text.substr(pos + 1, close - pos - 1);
+                pos = close + 1;
+                return true;
+            }
+
+            size_t start = pos;
+            if (text[pos] == '{' || text[pos] == '}')
+                pos++;
+            else
+            {
+                while (pos < text.size() && (unsigned char)text[pos] > ' ' && text[pos] != '{' && text[pos] != '}' && text[pos] != '"')
+                    pos++;
+            }
+            token = text.substr(start, pos - start);
+            return true;
+        }
+
+        void skip_space()
+        {
+            while (pos < text.size())
+            {
+                if ((unsigned char)text[pos] <= ' ')
+                    pos++;
+                else if (text.compare(pos, 2, "//") == 0)
+                {
+                    size_t line = text.find('\n', pos);
+                    pos = line == std::string_view::npos ? text.size() : line + 1;
+                }
+                else if (text.compare(pos, 2, "/*") == 0)
+                {
+                    size_t close = text.find("*/", pos + 2);
+                    pos = close == std::string_view::npos ? text.size() : close + 2;
+                }
+                else
+                    break;
+            }
+        }
+    };
+
+    bool is_brace(std::string_view token, bool quoted, char brace)
+    {
+        return !quoted && token.size() == 1 && token[0] == brace;
+    }
 }
 
-void EntityParser::parse(std::string entities, std::vector<entity>& store)
+void EntityParser::parse(std::string_view entities, std::vector<entity>& store)
 {
-    // break the entities string into lumps and parse each lump into an entity.
-    do
+    // the lump is usually NUL terminated, but nothing guarantees it
+    size_t end = entities.find('\0');
+    if (end != std::string_view::npos)
+        entities = entities.substr(0, end);
+
+    // one copy for every key and value to point into. views into the pair list are only
+    // handed out once it's done growing.
+    arena.assign(entities.data(), entities.size());
+    all_pairs.clear();
+
+    std::vector<int> counts;
+    tokenizer tokens{ arena };
+    std::string_view token;
+    bool quoted;
+
+    while (tokens.next(token, quoted))
     {
-        std::string ent;
-        int index = entities.find("}");
-        if (index == -1)
+        if (!is_brace(token, quoted, '{'))
+        {
+            std::cout << "EntityParser error: expected { at " << tokens.pos << '\n';
+            break;
+        }
+
+        size_t first = all_pairs.size();
+        bool closed = false;
+        while (tokens.next(token, quoted))
+        {
+            if (is_brace(token, quoted, '}'))
+            {
+                closed = true;
+                break;
+            }
+
+            std::string_view key = token;
+            if (is_brace(key, quoted, '{') || !tokens.next(token, quoted) || is_brace(token, quoted, '{') || is_brace(token, quoted, '}'))
+                break;
+
+            all_pairs.push_back(entity_pair{ key, token });
+        }
+
+        if (!closed)
+        {
+            std::cout << "EntityParser error: unfinished entity at " << tokens.pos << '\n';
+            all_pairs.resize(first);
             break;
-        ent = entities.substr(0, index+1);
-        entities.erase(0, index+2);
+        }
 
-        store.push_back(parse(ent));
+        counts.push_back((int)(all_pairs.size() - first));
+    }
 
-    } while (true);
+    const entity_pair* next = all_pairs.data();
+    for (int count : counts)
+    {
+        entity ent;
+        ent.pairs = next;
+        ent.n_pairs = count;
+        store.push_back(ent);
+        next += count;
+    }
 }
@@ -1,25 +1,47 @@
 #pragma once
 
-#include <map>
-#include <vector>
 #include <string>
+#include <string_view>
+#include <vector>
 #include "glm/glm.hpp"
 
+// a key and its value, both pointing into the parser's arena
+struct entity_pair
+{
+	std::string_view key;
+	std::string_view value;
+};
+
+// one { } block of the entity lump. it refers to the parser that made it, so the parser
+// has to outlive it.
 struct entity
 {
 public:
-	glm::vec3 origin;
-	std::map<std::string, std::string> pairs;
+	const entity_pair* pairs{ nullptr };
+	int n_pairs{ 0 };
+
+	// the first value for key, with found set to whether there was one
+	std::string_view find(std::string_view key, bool& found) const;
+	bool has(std::string_view key) const;
 
-	float get_float(std::string key);
-	std::string get_string(std::string key);
-	void get_vec3(std::string key, glm::vec3& vec);
+	// 0, "" and untouched respectively when the key isn't there
+	float get_float(std::string_view key) const;
+	std::string_view get_string(std::string_view key) const;
+	void get_vec3(std::string_view key, glm::vec3& vec) const;
 };
 
+// single pass tokenizer for the entity lump: braces, quoted strings and // comments, the
+// same tokens q3's COM_Parse sees. the lump is copied once and every key and value is a
+// view into that copy.
 class EntityParser
 {
 public:
-	entity parse(std::string ent);
-	void parse(std::string entities, std::vector<entity>& store);
-};
+	// the lump doesn't need to be terminated, it ends at the first NUL or the end of the view.
+	// entities parsed before a syntax error are kept. parsing again invalidates the entities
+	// from the last parse.
+	void parse(std::string_view entities, std::vector<entity>& store);
 
+private:
+	std::string arena;
+	std::vector<entity_pair> all_pairs;
+};
@@ -0,0 +1,246 @@
+#include "EntityStore.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+// no side of the grid gets more cells than this, however spread out the map is
+const int MaxGridCells = 64;
+// about this many entities to a cell, and cells no smaller than this in units
+const int EntitiesPerCell = 2;
+const float MinCellSize = 64.f;
+// classes this small are faster to scan than to look up in the grid
+const int SmallClass = 32;
+
+void EntityStore::clear()
+{
+	parsed.clear();
+	entities.clear();
+	classnames.clear();
+	classname_ids.clear();
+	class_members.clear();
+	cell_start.clear();
+	cell_entities.clear();
+	grid_size[0] = grid_size[1] = grid_size[2] = 0;
+}
+
+void EntityStore::build(std::string_view lump)
+{
+	clear();
+	parser.parse(lump, parsed);
+
+	entities.reserve(parsed.size());
+	for (const entity& ent : parsed)
+	{
+		stored_entity stored;
+		stored.fields = ent;
+
+		std::string_view name = ent.get_string("classname");
+		auto found = classname_ids.find(name);
+		if (found == classname_ids.end())
+		{
+			found = classname_ids.emplace(name, (int)classnames.size()).first;
+			classnames.push_back(name);
+			class_members.emplace_back();
+		}
+		stored.classname = found->second;
+		class_members[stored.classname].push_back((int)entities.size());
+
+		stored.has_origin = ent.has("origin");
+		stored.origin = glm::vec3(0.f);
+		ent.get_vec3("origin", stored.origin);
+
+		stored.angles = glm::vec3(0.f, ent.get_float("angle"), 0.f);
+		ent.get_vec3("angles", stored.angles);
+
+		stored.model = ent.get_string("model");
+		entities.push_back(stored);
+	}
+
+	build_grid();
+}
+
+void EntityStore::build_grid()
+{
+	glm::vec3 mins(FLT_MAX), maxs(-FLT_MAX);
+	int placed = 0;
+	for (const auto& ent : entities)
+	{
+		if (!ent.has_origin) continue;
+		mins = glm::min(mins, ent.origin);
+		maxs = glm::max(maxs, ent.origin);
+		placed++;
+	}
+
+	if (placed == 0) return;
+
+	// cells sized so each holds a couple of entities if they were spread evenly
+	glm::vec3 extent = maxs - mins;
+	float volume = std::max(extent.x, 1.f) * std::max(extent.y, 1.f) * std::max(extent.z, 1.f);
+	cell_size = std::max(cbrtf(volume * EntitiesPerCell / placed), MinCellSize);
+	for (int k = 0; k < 3; ++k)
+		cell_size = std::max(cell_size, extent[k] / MaxGridCells);
+
+	grid_mins = mins;
+	for (int k = 0; k < 3; ++k)
+		grid_size[k] = std::min((int)(extent[k] / cell_size) + 1, MaxGridCells);
+
+	// counting sort of the entities into their cells
+	int cells = grid_size[0] * grid_size[1] * grid_size[2];
+	cell_start.assign(cells + 1, 0);
+	std::vector<int> entity_cell(entities.size(), -1);
+	for (int i = 0; i < entities.size(); ++i)
+	{
+		if (!entities[i].has_origin) continue;
+		int cell[3];
+		cell_of(entities[i].origin, cell);
+		entity_cell[i] = (cell[2] * grid_size[1] + cell[1]) * grid_size[0] + cell[0];
+		cell_start[entity_cell[i] + 1]++;
+	}
+
+	for (int c = 0; c < cells; ++c)
+		cell_start[c + 1] += cell_start[c];
+
+	std::vector<int> next(cell_start.begin(), cell_start.end() - 1);
+	cell_entities.resize(placed);
+	for (int i = 0; i < entities.size(); ++i)
+	{
+		if (entity_cell[i] >= 0)
+			cell_entities[next[entity_cell[i]]++] = i;
+	}
+}
+
+void EntityStore::cell_of(const glm::vec3& point, int cell[3]) const
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		int c = (int)floorf((point[k] - grid_mins[k]) / cell_size);
+		cell[k] = std::min(std::max(c, 0), grid_size[k] - 1);
+	}
+}
+
+int EntityStore::find_classname(std::string_view name) const
+{
+	auto found = classname_ids.find(name);
+	return found == classname_ids.end() ? -1 : found->second;
+}
+
+const std::vector<int>& EntityStore::of_class(int id) const
+{
+	if (id < 0 || id >= (int)class_members.size()) return no_members;
+	return class_members[id];
+}
+
+void EntityStore::within(const glm::vec3& point, float radius, int classname, std::vector<int>& out) const
+{
+	if (cell_entities.empty()) return;
+
+	float radius2 = radius * radius;
+	int lo[3], hi[3];
+	cell_of(point - glm::vec3(radius), lo);
+	cell_of(point + glm::vec3(radius), hi);
+
+	for (int z = lo[2]; z <= hi[2]; ++z)
+	{
+		for (int y = lo[1]; y <= hi[1]; ++y)
+		{
+			for (int x = lo[0]; x <= hi[0]; ++x)
+			{
+				int c = (z * grid_size[1] + y) * grid_size[0] + x;
+				for (int i = cell_start[c]; i < cell_start[c + 1]; ++i)
+				{
+					const stored_entity& ent = entities[cell_entities[i]];
+					if (classname != AnyClass && ent.classname != classname) continue;
+
+					glm::vec3 d = ent.origin - point;
+					if (glm::dot(d, d) <= radius2)
+						out.push_back(cell_entities[i]);
+				}
+			}
+		}
+	}
+}
+
+void EntityStore::nearest_in_cell(int x, int y, int z, const glm::vec3& point, int classname, float& best_distance2, int& best) const
+{
+	int c = (z * grid_size[1] + y) * grid_size[0] + x;
+	for (int i = cell_start[c]; i < cell_start[c + 1]; ++i)
+	{
+		const stored_entity& ent = entities[cell_entities[i]];
+		if (classname != AnyClass && ent.classname != classname) continue;
+
+		glm::vec3 d = ent.origin - point;
+		float distance2 = glm::dot(d, d);
+		if (distance2 < best_distance2)
+		{
+			best_distance2 = distance2;
+			best = cell_entities[i];
+		}
+	}
+}
+
+int EntityStore::nearest(const glm::vec3& point, int classname, float max_distance) const
+{
+	if (cell_entities.empty()) return -1;
+
+	float best_distance2 = max_distance < FLT_MAX ? max_distance * max_distance : FLT_MAX;
+	int best = -1;
+
+	// a handful of spawn points or flags are quicker to check directly
+	if (classname != AnyClass && of_class(classname).size() <= SmallClass)
+	{
+		for (int index : of_class(classname))
+		{
+			if (!entities[index].has_origin) continue;
+			glm::vec3 d = entities[index].origin - point;
+			float distance2 = glm::dot(d, d);
+			if (distance2 < best_distance2)
+			{
+				best_distance2 = distance2;
+				best = index;
+			}
+		}
+		return best;
+	}
+
+	// search shells of cells outwards from the point's cell. anything in shell r + 1 is at
+	// least r cells away, so once the best is closer than that the search is done. a point
+	// outside the grid is only further from everything than its clamped cell suggests.
+	int centre[3];
+	cell_of(point, centre);
+	int shells = std::max(grid_size[0], std::max(grid_size[1], grid_size[2]));
+
+	for (int r = 0; r < shells; ++r)
+	{
+		int lo[3], hi[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			lo[k] = std::max(centre[k] - r, 0);
+			hi[k] = std::min(centre[k] + r, grid_size[k] - 1);
+		}
+
+		for (int z = lo[2]; z <= hi[2]; ++z)
+		{
+			for (int y = lo[1]; y <= hi[1]; ++y)
+			{
+				bool inner = abs(z - centre[2]) < r && abs(y - centre[1]) < r;
+				for (int x = lo[0]; x <= hi[0]; ++x)
+				{
+					// the inside of the shell was covered by the smaller ones
+					if (inner && abs(x - centre[0]) < r)
+					{
+						x = centre[0] + r - 1;
+						continue;
+					}
+					nearest_in_cell(x, y, z, point, classname, best_distance2, best);
+				}
+			}
+		}
+
+		// also ends the search once nothing further out could be within max_distance
+		float reach = r * cell_size;
+		if (reach * reach >= best_distance2) break;
+	}
+
+	return best;
+}
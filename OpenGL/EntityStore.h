@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cfloat>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "EntityParser.h"
+
+// an entity with the fields nearly everything looks at already parsed
+struct stored_entity
+{
+	int classname;			// interned, see EntityStore::classname
+	bool has_origin;
+	glm::vec3 origin;
+	glm::vec3 angles;		// pitch, yaw, roll. "angle" on its own is the yaw
+	std::string_view model;
+	entity fields;			// every key and value, for anything else
+};
+
+// a class for within and nearest that matches every entity. it isn't -1 so a class
+// find_classname didn't find matches nothing instead.
+const int AnyClass = -2;
+
+// the map's entities, parsed once, with classnames interned and listed by class, and the
+// origins in a uniform grid for radius and nearest queries like finding spawn points or
+// the items around a player.
+class EntityStore
+{
+public:
+	void build(std::string_view lump);
+	void clear();
+
+	int size() const { return (int)entities.size(); }
+	const stored_entity& get(int index) const { return entities[index]; }
+
+	// the id of a classname, -1 if no entity has it
+	int find_classname(std::string_view name) const;
+	std::string_view classname(int id) const { return classnames[id]; }
+	int classname_count() const { return (int)classnames.size(); }
+
+	// every entity of a class, in lump order
+	const std::vector<int>& of_class(int id) const;
+	const std::vector<int>& of_class(std::string_view name) const { return of_class(find_classname(name)); }
+
+	// entities with an origin within radius of point, of one class or any with AnyClass. the
+	// indices are appended to out in no particular order.
+	void within(const glm::vec3& point, float radius, int classname, std::vector<int>& out) const;
+	// the entity with an origin closest to point, -1 if none are within max_distance
+	int nearest(const glm::vec3& point, int classname = AnyClass, float max_distance = FLT_MAX) const;
+
+private:
+	void build_grid();
+	void cell_of(const glm::vec3& point, int cell[3]) const;
+	// checks one cell's entities against the best so far
+	void nearest_in_cell(int x, int y, int z, const glm::vec3& point, int classname, float& best_distance2, int& best) const;
+
+	EntityParser parser;
+	std::vector<entity> parsed;
+	std::vector<stored_entity> entities;
+
+	// views into the parser's arena
+	std::vector<std::string_view> classnames;
+	std::unordered_map<std::string_view, int> classname_ids;
+	std::vector<std::vector<int>> class_members;
+	std::vector<int> no_members;
+
+	// cell_start[c] to cell_start[c + 1] in cell_entities are the entities in cell c, x major
+	glm::vec3 grid_mins{ 0.f };
+	float cell_size{ 1.f };
+	int grid_size[3]{ 0, 0, 0 };
+	std::vector<int> cell_start;
+	std::vector<int> cell_entities;
+};
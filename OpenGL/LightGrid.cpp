@@ -0,0 +1,245 @@
+#include "LightGrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Simd.h"
+
+const glm::vec3 GridSpacing(64.f, 64.f, 128.f);
+// directions are stored as two angles in 256ths of a turn
+const float ByteAngle = 6.28318531f / 256.f;
+
+void LightGrid::clear()
+{
+	cells.clear();
+	origin = glm::vec3(0.f);
+	size[0] = size[1] = size[2] = 0;
+}
+
+void LightGrid::build(const unsigned char* data, int cell_count, const glm::vec3& world_mins, const glm::vec3& world_maxs)
+{
+	clear();
+
+	// the grid covers whole cells inside the world bounds
+	glm::vec3 mins = GridSpacing * glm::ceil(world_mins / GridSpacing);
+	glm::vec3 maxs = GridSpacing * glm::floor(world_maxs / GridSpacing);
+	for (int k = 0; k < 3; ++k)
+		size[k] = std::max(0, (int)((maxs[k] - mins[k]) / GridSpacing[k]) + 1);
+
+	if (cell_count <= 0 || cell_count != size[0] * size[1] * size[2])
+	{
+		size[0] = size[1] = size[2] = 0;
+		return;
+	}
+
+	origin = mins;
+	cells.resize(cell_count);
+
+	// unpack the bytes and decode the directions once, so a sample is just a weighted sum
+	for (int i = 0; i < cell_count; ++i)
+	{
+		const unsigned char* src = data + i * 8;
+		cell& c = cells[i];
+
+		for (int k = 0; k < 3; ++k)
+		{
+			c.ambient[k] = src[k];
+			c.directed[k] = src[3 + k];
+		}
+		c.ambient[3] = src[0] + src[1] + src[2] > 0 ? 1.f : 0.f;
+		c.directed[3] = 0.f;
+
+		float lng = src[6] * ByteAngle;
+		float lat = src[7] * ByteAngle;
+		c.direction[0] = cosf(lat) * sinf(lng);
+		c.direction[1] = sinf(lat) * sinf(lng);
+		c.direction[2] = cosf(lng);
+		c.direction[3] = 0.f;
+	}
+}
+
+void LightGrid::locate(const glm::vec3& local, int& base, int next[3], float frac[3]) const
+{
+	int step[3] = { 1, size[0], size[0] * size[1] };
+	base = 0;
+	for (int k = 0; k < 3; ++k)
+	{
+		float cell_pos = floorf(local[k]);
+		frac[k] = local[k] - cell_pos;
+		int pos = (int)cell_pos;
+
+		// outside the grid the edge cells are used as they are
+		if (pos < 0)
+		{
+			pos = 0;
+			frac[k] = 0.f;
+		}
+		else if (pos >= size[k] - 1)
+		{
+			pos = size[k] - 1;
+			frac[k] = 0.f;
+		}
+
+		base += pos * step[k];
+		next[k] = pos + 1 < size[k] ? step[k] : 0;
+	}
+}
+
+// total is the weight of the cells that were used, less than 1 next to walls
+static void resolve(const glm::vec3& ambient, float total, const glm::vec3& directed, const glm::vec3& direction, light_sample& out)
+{
+	float scale = total > 0.f && total < 0.99f ? 1.f / total : 1.f;
+
+	out.ambient = ambient * scale;
+	out.directed = directed * scale;
+
+	float length = glm::length(direction);
+	out.direction = length > 0.f ? direction / length : glm::vec3(0.f, 0.f, 1.f);
+}
+
+void LightGrid::blend(const glm::vec3& local, light_sample& out) const
+{
+	int base, next[3];
+	float frac[3];
+	locate(local, base, next, frac);
+
+	float ambient[4] = {}, directed[3] = {}, direction[3] = {};
+
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		float factor = 1.f;
+		int index = base;
+		for (int k = 0; k < 3; ++k)
+		{
+			if (corner & (1 << k))
+			{
+				factor *= frac[k];
+				index += next[k];
+			}
+			else
+				factor *= 1.f - frac[k];
+		}
+
+		if (factor == 0.f) continue;
+
+		// cells in walls have no light and would darken everything next to them.
+		// the weight lane is 0 for those, which zeroes the whole contribution.
+		const cell& c = cells[index];
+		factor *= c.ambient[3];
+
+		for (int k = 0; k < 4; ++k)
+			ambient[k] += factor * c.ambient[k];
+		for (int k = 0; k < 3; ++k)
+		{
+			directed[k] += factor * c.directed[k];
+			direction[k] += factor * c.direction[k];
+		}
+	}
+
+	resolve(glm::vec3(ambient[0], ambient[1], ambient[2]), ambient[3],
+		glm::vec3(directed[0], directed[1], directed[2]), glm::vec3(direction[0], direction[1], direction[2]), out);
+}
+
+#if USE_SSE2
+void LightGrid::blend4(const glm::vec3* local, light_sample* out) const
+{
+	int base[4], next[4][3];
+	float frac[4][3];
+	for (int lane = 0; lane < 4; ++lane)
+		locate(local[lane], base[lane], next[lane], frac[lane]);
+
+	const __m128 one = _mm_set1_ps(1.f);
+	__m128 f[3];
+	for (int k = 0; k < 3; ++k)
+		f[k] = _mm_setr_ps(frac[0][k], frac[1][k], frac[2][k], frac[3][k]);
+
+	// one lane per point and one register per channel: ambient rgb, the weight, directed rgb
+	// and the direction
+	__m128 sum[10];
+	for (int channel = 0; channel < 10; ++channel)
+		sum[channel] = _mm_setzero_ps();
+
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		__m128 factor = one;
+		int index[4] = { base[0], base[1], base[2], base[3] };
+		for (int k = 0; k < 3; ++k)
+		{
+			if (corner & (1 << k))
+			{
+				factor = _mm_mul_ps(factor, f[k]);
+				for (int lane = 0; lane < 4; ++lane)
+					index[lane] += next[lane][k];
+			}
+			else
+				factor = _mm_mul_ps(factor, _mm_sub_ps(one, f[k]));
+		}
+
+		const cell& c0 = cells[index[0]];
+		const cell& c1 = cells[index[1]];
+		const cell& c2 = cells[index[2]];
+		const cell& c3 = cells[index[3]];
+
+		// a corner a point doesn't use has a factor of 0 and adds nothing, as does a cell in a wall
+		factor = _mm_mul_ps(factor, _mm_setr_ps(c0.ambient[3], c1.ambient[3], c2.ambient[3], c3.ambient[3]));
+
+		for (int k = 0; k < 4; ++k)
+			sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(factor, _mm_setr_ps(c0.ambient[k], c1.ambient[k], c2.ambient[k], c3.ambient[k])));
+		for (int k = 0; k < 3; ++k)
+		{
+			sum[4 + k] = _mm_add_ps(sum[4 + k], _mm_mul_ps(factor, _mm_setr_ps(c0.directed[k], c1.directed[k], c2.directed[k], c3.directed[k])));
+			sum[7 + k] = _mm_add_ps(sum[7 + k], _mm_mul_ps(factor, _mm_setr_ps(c0.direction[k], c1.direction[k], c2.direction[k], c3.direction[k])));
+		}
+	}
+
+	alignas(16) float lanes[10][4];
+	for (int channel = 0; channel < 10; ++channel)
+		_mm_store_ps(lanes[channel], sum[channel]);
+
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		resolve(glm::vec3(lanes[0][lane], lanes[1][lane], lanes[2][lane]), lanes[3][lane],
+			glm::vec3(lanes[4][lane], lanes[5][lane], lanes[6][lane]), glm::vec3(lanes[7][lane], lanes[8][lane], lanes[9][lane]), out[lane]);
+	}
+}
+#endif
+
+light_sample LightGrid::sample(const glm::vec3& point) const
+{
+	light_sample result;
+	sample(&point, 1, &result);
+	return result;
+}
+
+void LightGrid::sample(const glm::vec3* points, int count, light_sample* out) const
+{
+	if (cells.empty())
+	{
+		std::fill(out, out + count, light_sample{});
+		return;
+	}
+
+	int i = 0;
+
+#if USE_SSE2
+	// grid space positions for four points at once, then their corners blended a point a lane
+	const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	const __m128 sx = _mm_set1_ps(1.f / GridSpacing.x), sy = _mm_set1_ps(1.f / GridSpacing.y), sz = _mm_set1_ps(1.f / GridSpacing.z);
+
+	for (; i + 4 <= count; i += 4)
+	{
+		alignas(16) float local[3][4];
+		_mm_store_ps(local[0], _mm_mul_ps(_mm_sub_ps(_mm_set_ps(points[i + 3].x, points[i + 2].x, points[i + 1].x, points[i].x), ox), sx));
+		_mm_store_ps(local[1], _mm_mul_ps(_mm_sub_ps(_mm_set_ps(points[i + 3].y, points[i + 2].y, points[i + 1].y, points[i].y), oy), sy));
+		_mm_store_ps(local[2], _mm_mul_ps(_mm_sub_ps(_mm_set_ps(points[i + 3].z, points[i + 2].z, points[i + 1].z, points[i].z), oz), sz));
+
+		glm::vec3 batch[4];
+		for (int k = 0; k < 4; ++k)
+			batch[k] = glm::vec3(local[0][k], local[1][k], local[2][k]);
+		blend4(batch, out + i);
+	}
+#endif
+
+	for (; i < count; ++i)
+		blend((points[i] - origin) * (1.f / GridSpacing), out[i]);
+}
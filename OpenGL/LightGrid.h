@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// light at a point from the map's light grid. colours are on the same 0-255 scale as the
+// lightmaps, direction points towards the light.
+struct light_sample
+{
+	glm::vec3 ambient{ 0.f };
+	glm::vec3 directed{ 0.f };
+	glm::vec3 direction{ 0.f, 0.f, 1.f };
+};
+
+// q3's ambient/directional light grid: one cell every 64x64x128 units over the world model's
+// bounds, each with an ambient colour, a directed colour and the direction it comes from.
+// samples blend the eight surrounding cells, ignoring cells that are inside walls.
+class LightGrid
+{
+public:
+	// cells are 8 bytes each (ambient rgb, directed rgb, longitude, latitude) in x, y, z order
+	void build(const unsigned char* cells, int cell_count, const glm::vec3& world_mins, const glm::vec3& world_maxs);
+	void clear();
+
+	light_sample sample(const glm::vec3& point) const;
+	// a batch of points, four at a time with one point to a lane where there's sse2. for
+	// lighting every entity a map places in one go.
+	void sample(const glm::vec3* points, int count, light_sample* out) const;
+
+	bool empty() const { return cells.empty(); }
+
+private:
+	// channels of a cell padded to whole vectors: ambient and a weight of 1 (0 for a cell in
+	// a wall), directed, then the unit direction
+	struct cell
+	{
+		float ambient[4];
+		float directed[4];
+		float direction[4];
+	};
+
+	// the cell below a grid space position, the step to the next cell along each axis (0 at
+	// the far edge) and how far into the cell it is
+	void locate(const glm::vec3& local, int& base, int next[3], float frac[3]) const;
+	void blend(const glm::vec3& local, light_sample& out) const;
+	// four grid space positions, one to a lane
+	void blend4(const glm::vec3* local, light_sample* out) const;
+
+	std::vector<cell> cells;
+	glm::vec3 origin{ 0.f };
+	int size[3]{ 0, 0, 0 };
+};
@@ -0,0 +1,110 @@
+#include "LineOfSight.h"
+
+#include <cstring>
+
+#include "ThreadPool.h"
+
+// pairs are looked up with the lower point first so a-b and b-a share an answer
+static bool point_less(const glm::vec3& a, const glm::vec3& b)
+{
+	if (a.x != b.x) return a.x < b.x;
+	if (a.y != b.y) return a.y < b.y;
+	return a.z < b.z;
+}
+
+size_t LineOfSight::pair_hash::operator()(const pair_key& key) const
+{
+	unsigned int bits[7];
+	memcpy(&bits[0], &key.a, sizeof(float) * 3);
+	memcpy(&bits[3], &key.b, sizeof(float) * 3);
+	bits[6] = (unsigned int)key.contentmask;
+
+	unsigned long long hash = 14695981039346656037ull;
+	for (unsigned int value : bits)
+		hash = (hash ^ value) * 1099511628211ull;
+
+	return (size_t)hash;
+}
+
+void LineOfSight::begin_tick()
+{
+	cache.clear();
+	stats = sight_stats{};
+}
+
+void LineOfSight::test(const sight_query* queries, int count, unsigned char* visible, int contentmask)
+{
+	if (count <= 0) return;
+
+	// leafs for both ends of every pair in one batch
+	points.resize(count * 2);
+	leafs.resize(count * 2);
+	for (int i = 0; i < count; ++i)
+	{
+		points[i * 2] = queries[i].from;
+		points[i * 2 + 1] = queries[i].to;
+	}
+	collision.point_leafs(&points[0], count * 2, &leafs[0]);
+
+	waiting.assign(count, -1);
+	pending.clear();
+
+	stats.queries += count;
+
+	for (int i = 0; i < count; ++i)
+	{
+		int from = collision.empty() ? 0 : collision.leaf_cluster(leafs[i * 2]);
+		int to = collision.empty() ? 0 : collision.leaf_cluster(leafs[i * 2 + 1]);
+
+		if (!collision.cluster_visible(from, to))
+		{
+			visible[i] = 0;
+			stats.pvs_rejected++;
+			continue;
+		}
+
+		pair_key key;
+		bool swap = point_less(queries[i].to, queries[i].from);
+		key.a = swap ? queries[i].to : queries[i].from;
+		key.b = swap ? queries[i].from : queries[i].to;
+		key.contentmask = contentmask;
+
+		auto found = cache.find(key);
+		if (found != cache.end())
+		{
+			stats.cached++;
+			if (found->second >= 0)
+				visible[i] = (unsigned char)found->second;
+			else
+				waiting[i] = -1 - found->second;
+			continue;
+		}
+
+		waiting[i] = (int)pending.size();
+		cache.emplace(key, -1 - (int)pending.size());
+		pending.push_back(sight_query{ key.a, key.b });
+	}
+
+	// the pairs the pvs couldn't settle get a real trace, spread over the workers
+	pending_visible.resize(pending.size());
+	ThreadPool::shared().parallel_for((int)pending.size(), 32, [&](int begin, int end) {
+		for (int p = begin; p < end; ++p)
+		{
+			trace_result result = collision.trace(pending[p].from, pending[p].to, glm::vec3(0.f), glm::vec3(0.f), contentmask);
+			pending_visible[p] = result.fraction == 1.f && !result.start_solid ? 1 : 0;
+		}
+	});
+	stats.traced += (int)pending.size();
+
+	for (int p = 0; p < pending.size(); ++p)
+	{
+		pair_key key{ pending[p].from, pending[p].to, contentmask };
+		cache[key] = pending_visible[p];
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (waiting[i] >= 0)
+			visible[i] = pending_visible[waiting[i]];
+	}
+}
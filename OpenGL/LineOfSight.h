@@ -0,0 +1,72 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "CollisionModel.h"
+
+// can a point at from see a point at to
+struct sight_query
+{
+	glm::vec3 from;
+	glm::vec3 to;
+};
+
+struct sight_stats
+{
+	int queries{ 0 };
+	int pvs_rejected{ 0 };	// settled by the pvs bit alone
+	int cached{ 0 };		// answered by an earlier query this tick
+	int traced{ 0 };
+};
+
+// batched line of sight checks for a game tick. pairs in clusters the pvs says can't see
+// each other are rejected straight away, the rest are traced against the solid brushes on
+// the worker threads. answers are kept until the next tick, and the pair is checked the
+// same both ways round.
+class LineOfSight
+{
+public:
+	explicit LineOfSight(const CollisionModel& model) : collision(model) {}
+
+	// forgets the cached answers, call whenever anything that blocks sight may have moved
+	void begin_tick();
+
+	// writes 1 to visible[i] when queries[i] is unobstructed and 0 otherwise
+	void test(const sight_query* queries, int count, unsigned char* visible, int contentmask = CONTENTS_SOLID);
+
+	// totals since begin_tick
+	sight_stats get_stats() const { return stats; }
+
+private:
+	struct pair_key
+	{
+		glm::vec3 a;
+		glm::vec3 b;
+		int contentmask;
+
+		bool operator==(const pair_key& other) const
+		{
+			return a == other.a && b == other.b && contentmask == other.contentmask;
+		}
+	};
+
+	struct pair_hash
+	{
+		size_t operator()(const pair_key& key) const;
+	};
+
+	const CollisionModel& collision;
+
+	// answer per pair, or -1 - the index of the pending trace that will answer it
+	std::unordered_map<pair_key, int, pair_hash> cache;
+	sight_stats stats;
+
+	// scratch, kept between batches so a tick doesn't allocate once it has warmed up
+	std::vector<glm::vec3> points;
+	std::vector<int> leafs;
+	std::vector<int> waiting;	// per query, the pending trace it waits on or -1
+	std::vector<sight_query> pending;
+	std::vector<unsigned char> pending_visible;
+};
@@ -0,0 +1,154 @@
+#include "MD3Kernel.h"
+
+#include <math.h>
+
+#include "Simd.h"
+
+static glm::vec3 reference_normal(short packed)
+{
+	float lat = ((packed >> 8) & 0xff) * MD3_BYTE_ANGLE;
+	float lng = (packed & 0xff) * MD3_BYTE_ANGLE;
+	return glm::vec3(cosf(lat) * sinf(lng), sinf(lat) * sinf(lng), cosf(lng));
+}
+
+static glm::vec3 table_normal(short packed)
+{
+	return MD3Loader::NormalTable()[(unsigned short)packed];
+}
+
+// blends one vertex, used by the reference path and for the kernel's leftovers
+static void lerp_vertex(const MD3Vertex& from, const MD3Vertex& to, float fraction, bool table, model_vertex& out)
+{
+	glm::vec3 a = glm::vec3(from.vert) * MD3_XYZ_SCALE;
+	glm::vec3 b = glm::vec3(to.vert) * MD3_XYZ_SCALE;
+	out.position = a + (b - a) * fraction;
+
+	glm::vec3 na = table ? table_normal(from.normal) : reference_normal(from.normal);
+	glm::vec3 nb = table ? table_normal(to.normal) : reference_normal(to.normal);
+	glm::vec3 n = na + (nb - na) * fraction;
+
+	// opposite normals blend through zero, leave those as they are
+	float length = sqrtf(glm::dot(n, n));
+	out.normal = length > 1e-6f ? n * (1.f / length) : n;
+}
+
+void MD3Kernel::lerp_reference(const md3_lerp* surfaces, int count)
+{
+	for (int s = 0; s < count; ++s)
+	{
+		const md3_lerp& surface = surfaces[s];
+		for (int i = 0; i < surface.count; ++i)
+			lerp_vertex(surface.from[i], surface.to[i], surface.fraction, false, surface.out[i]);
+	}
+}
+
+#if USE_SSE2
+// four vertices turned on their side: positions as floats in file units, normals as the
+// packed shorts zero extended to 32 bits
+static inline void load_vertices(const MD3Vertex* v, __m128& x, __m128& y, __m128& z, __m128i& normal)
+{
+	__m128i a = _mm_loadu_si128((const __m128i*)v);			// x0 y0 z0 n0 x1 y1 z1 n1
+	__m128i b = _mm_loadu_si128((const __m128i*)(v + 2));	// x2 y2 z2 n2 x3 y3 z3 n3
+
+	__m128i t0 = _mm_unpacklo_epi16(a, b);	// x0 x2 y0 y2 z0 z2 n0 n2
+	__m128i t1 = _mm_unpackhi_epi16(a, b);	// x1 x3 y1 y3 z1 z3 n1 n3
+	__m128i xy = _mm_unpacklo_epi16(t0, t1);
+	__m128i zn = _mm_unpackhi_epi16(t0, t1);
+
+	// doubling each short up then shifting back down sign extends it
+	x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(xy, xy), 16));
+	y = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(xy, xy), 16));
+	z = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(zn, zn), 16));
+	normal = _mm_unpackhi_epi16(zn, _mm_setzero_si128());
+}
+
+// there's no gather in sse2, so each lane's normal is fetched from the table on its own
+static inline void decode_normals(const glm::vec3* table, __m128i packed, __m128& x, __m128& y, __m128& z)
+{
+	alignas(16) int bits[4];
+	_mm_store_si128((__m128i*)bits, packed);
+
+	const glm::vec3& n0 = table[bits[0]];
+	const glm::vec3& n1 = table[bits[1]];
+	const glm::vec3& n2 = table[bits[2]];
+	const glm::vec3& n3 = table[bits[3]];
+	x = _mm_setr_ps(n0.x, n1.x, n2.x, n3.x);
+	y = _mm_setr_ps(n0.y, n1.y, n2.y, n3.y);
+	z = _mm_setr_ps(n0.z, n1.z, n2.z, n3.z);
+}
+
+static void lerp_surface(const md3_lerp& surface)
+{
+	const __m128 scale = _mm_set1_ps(MD3_XYZ_SCALE);
+	const __m128 fraction = _mm_set1_ps(surface.fraction);
+	const __m128 smallest = _mm_set1_ps(1e-12f);
+	const glm::vec3* normals = MD3Loader::NormalTable();
+	// a static model or one resting on a frame only needs decoding
+	const bool still = surface.from == surface.to || surface.fraction == 0.f;
+
+	alignas(16) float px[4], py[4], pz[4], nx[4], ny[4], nz[4];
+
+	int i = 0;
+	for (; i + 4 <= surface.count; i += 4)
+	{
+		__m128 ax, ay, az, bx, by, bz;
+		__m128i an, bn;
+		load_vertices(surface.from + i, ax, ay, az, an);
+
+		__m128 fx, fy, fz;
+		decode_normals(normals, an, fx, fy, fz);
+
+		if (!still)
+		{
+			load_vertices(surface.to + i, bx, by, bz, bn);
+			ax = _mm_add_ps(ax, _mm_mul_ps(_mm_sub_ps(bx, ax), fraction));
+			ay = _mm_add_ps(ay, _mm_mul_ps(_mm_sub_ps(by, ay), fraction));
+			az = _mm_add_ps(az, _mm_mul_ps(_mm_sub_ps(bz, az), fraction));
+
+			__m128 tx, ty, tz;
+			decode_normals(normals, bn, tx, ty, tz);
+			fx = _mm_add_ps(fx, _mm_mul_ps(_mm_sub_ps(tx, fx), fraction));
+			fy = _mm_add_ps(fy, _mm_mul_ps(_mm_sub_ps(ty, fy), fraction));
+			fz = _mm_add_ps(fz, _mm_mul_ps(_mm_sub_ps(tz, fz), fraction));
+
+			__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz));
+			__m128 inverse = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(_mm_max_ps(length2, smallest)));
+			// normals that blended through zero are left as they are, like the scalar path
+			__m128 keep = _mm_cmple_ps(length2, smallest);
+			inverse = _mm_or_ps(_mm_and_ps(keep, _mm_set1_ps(1.f)), _mm_andnot_ps(keep, inverse));
+			fx = _mm_mul_ps(fx, inverse);
+			fy = _mm_mul_ps(fy, inverse);
+			fz = _mm_mul_ps(fz, inverse);
+		}
+
+		_mm_store_ps(px, _mm_mul_ps(ax, scale));
+		_mm_store_ps(py, _mm_mul_ps(ay, scale));
+		_mm_store_ps(pz, _mm_mul_ps(az, scale));
+		_mm_store_ps(nx, fx);
+		_mm_store_ps(ny, fy);
+		_mm_store_ps(nz, fz);
+
+		for (int k = 0; k < 4; ++k)
+		{
+			model_vertex& out = surface.out[i + k];
+			out.position = glm::vec3(px[k], py[k], pz[k]);
+			out.normal = glm::vec3(nx[k], ny[k], nz[k]);
+		}
+	}
+
+	for (; i < surface.count; ++i)
+		lerp_vertex(surface.from[i], surface.to[i], still ? 0.f : surface.fraction, true, surface.out[i]);
+}
+#else
+static void lerp_surface(const md3_lerp& surface)
+{
+	for (int i = 0; i < surface.count; ++i)
+		lerp_vertex(surface.from[i], surface.to[i], surface.fraction, true, surface.out[i]);
+}
+#endif
+
+void MD3Kernel::lerp(const md3_lerp* surfaces, int count)
+{
+	for (int s = 0; s < count; ++s)
+		lerp_surface(surfaces[s]);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "BSPLoader.h"
+
+// one surface blended between two of its frames
+struct md3_lerp
+{
+	const MD3Vertex* from;	// the surface's vertices in the frame being left
+	const MD3Vertex* to;	// and in the frame being moved to, can be the same frame
+	int count;
+	float fraction;			// 0 is all from, 1 is all to
+	model_vertex* out;		// positions and normals are written, texcoords are left alone
+};
+
+// decodes and interpolates md3 vertex frames: positions from 64ths of a unit, normals from
+// their latitude/longitude bytes, blended and renormalised the way q3 does it.
+class MD3Kernel
+{
+public:
+	// soa simd path, four vertices at a time with the packed normals looked up in
+	// MD3Loader::NormalTable
+	static void lerp(const md3_lerp* surfaces, int count);
+
+	// straightforward scalar path, kept to check the kernel against
+	static void lerp_reference(const md3_lerp* surfaces, int count);
+};
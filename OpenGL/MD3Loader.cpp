@@ -1,8 +1,9 @@
 #include "MD3Loader.h"
 #include "physfs/physfs.h"
 
+#include <cstring>
+#include <math.h>
 #include <vector>
-#include <SOIL2/SOIL2.h>
 
 int    LongSwap(int l)
 {
@@ -16,89 +17,127 @@ int    LongSwap(int l)
 	return ((int)b1 << 24) + ((int)b2 << 16) + ((int)b3 << 8) + b4;
 }
 
+// a view of count Ts at offset into the file, or null if they'd run off the end of it
+template<class T>
+static const T* file_view(const unsigned char* data, size_t size, long long offset, long long count)
+{
+	if (offset < 0 || count < 0 || (size_t)offset > size) return nullptr;
+	if ((size_t)count > (size - (size_t)offset) / sizeof(T)) return nullptr;
+	return reinterpret_cast<const T*>(data + offset);
+}
+
 bool MD3Loader::Load(Model& model, std::string filename)
 {
 	PHYSFS_File* handle = PHYSFS_openRead(filename.c_str());
 
 	if (!handle) return false;
 
-	MD3Header header;
-	PHYSFS_readBytes(handle, &header, sizeof(MD3Header));
+	// the whole file in one read. seeking backwards in a compressed pk3 entry restarts
+	// its decompression, so everything is parsed from memory instead.
+	PHYSFS_sint64 length = PHYSFS_fileLength(handle);
+	std::vector<unsigned char> file(length > 0 ? (size_t)length : 0);
+	PHYSFS_sint64 read = file.empty() ? 0 : PHYSFS_readBytes(handle, &file[0], file.size());
+	PHYSFS_close(handle);
 
-	std::vector<Surface> surfaces;
+	if (file.empty() || read != (PHYSFS_sint64)file.size()) return false;
 
-	PHYSFS_seek(handle, header.surfaces_offset);
+	return Parse(model, &file[0], file.size());
+}
 
-	int offset = header.surfaces_offset;
+bool MD3Loader::Parse(Model& model, const unsigned char* data, size_t size)
+{
+	const MD3Header* header = file_view<MD3Header>(data, size, 0, 1);
+	if (header == nullptr || memcmp(header->ident, "IDP3", 4) != 0) return false;
 
-	for (int i = 0; i < header.num_surfaces; ++i)
-	{
-		Surface surface;
-		PHYSFS_readBytes(handle, &surface.header, sizeof(MD3SurfaceHeader));
+	static_assert(sizeof(MD3Header) == 108 && sizeof(MD3SurfaceHeader) == 108, "md3 headers are 108 bytes");
+	static_assert(sizeof(MD3Frame) == 56 && sizeof(MD3Tag) == 112 && sizeof(MD3Vertex) == 8, "md3 records match the file");
+
+	const MD3Frame* frames = file_view<MD3Frame>(data, size, header->frames_offset, header->num_frames);
+	if (frames == nullptr) return false;
+
+	// tags are stored frame by frame, num_tags of them each
+	long long tag_total = (long long)header->num_tags * header->num_frames;
+	const MD3Tag* tags = file_view<MD3Tag>(data, size, header->tags_offset, tag_total);
+	if (tags == nullptr) return false;
+
+	std::vector<Surface> surfaces;
+
+	// each surface's offsets are from its own start, and the next starts where it ends
+	long long start = header->surfaces_offset;
 
-		offset += surface.header.end_offset;
+	for (int i = 0; i < header->num_surfaces; ++i)
+	{
+		const MD3SurfaceHeader* surface_header = file_view<MD3SurfaceHeader>(data, size, start, 1);
+		if (surface_header == nullptr || memcmp(surface_header->ident, "IDP3", 4) != 0) return false;
 
-		if (surface.header.ident[0] != 'I' && surface.header.ident[1] != 'D'
-			&& surface.header.ident[2] != 'P' && surface.header.ident[3] != '3') continue;
+		const MD3SurfaceHeader& h = *surface_header;
+		long long vertex_count = (long long)h.num_verts * h.num_frames;
 
-		PHYSFS_seek(handle, header.surfaces_offset + surface.header.triangles_offset);
-		surface.triangles.resize(surface.header.num_triangles);
-		PHYSFS_readBytes(handle, &surface.triangles[0], surface.header.num_triangles * sizeof(MD3Triangle));
+		const MD3Triangle* triangles = file_view<MD3Triangle>(data, size, start + h.triangles_offset, h.num_triangles);
+		const MD3Shader* shaders = file_view<MD3Shader>(data, size, start + h.shaders_offset, h.num_shaders);
+		const MD3TexCoord* texcoords = file_view<MD3TexCoord>(data, size, start + h.st_offset, h.num_verts);
+		const MD3Vertex* vertices = file_view<MD3Vertex>(data, size, start + h.vertex_offset, vertex_count);
 
-		std::vector<MD3Shader> shaders;
-		PHYSFS_seek(handle, header.surfaces_offset + surface.header.shaders_offset);
-		shaders.resize(surface.header.num_shaders);
-		PHYSFS_readBytes(handle, &shaders[0], surface.header.num_shaders * sizeof(MD3Shader));
+		if (!triangles || !shaders || !texcoords || !vertices || h.end_offset <= 0) return false;
 
-		for (int j = 0; j < shaders.size(); j++)
+		// triangles pointing past the surface's vertices would read outside them later
+		for (int t = 0; t < h.num_triangles; ++t)
 		{
-			surface.shaders.push_back(Shader{ shaders[j].name, shaders[j].index, -1 });
+			for (int k = 0; k < 3; ++k)
+			{
+				if (triangles[t].indexes[k] < 0 || triangles[t].indexes[k] >= h.num_verts) return false;
+			}
 		}
 
-		PHYSFS_seek(handle, header.surfaces_offset + surface.header.st_offset);
-		surface.texcoords.resize(surface.header.num_verts);
-		PHYSFS_readBytes(handle, &surface.texcoords[0], surface.header.num_verts * sizeof(MD3TexCoord));
+		Surface surface;
+		surface.header = h;
+		surface.triangles.assign(triangles, triangles + h.num_triangles);
+		surface.texcoords.assign(texcoords, texcoords + h.num_verts);
+		// every frame's vertices, one after another
+		surface.vertices.assign(vertices, vertices + vertex_count);
 
-		// we won't handle animation quite yet, so just one frames worth of verts
-		PHYSFS_seek(handle, header.surfaces_offset + surface.header.vertex_offset);
-		surface.vertices.resize(surface.header.num_verts);
-		PHYSFS_readBytes(handle, &surface.vertices[0], surface.header.num_verts * sizeof(MD3Vertex));
+		for (int j = 0; j < h.num_shaders; j++)
+		{
+			// names are fixed size and not always terminated
+			std::string name(shaders[j].name, strnlen(shaders[j].name, MAX_QPATH));
+			surface.shaders.push_back(SurfaceShader{ name, shaders[j].index, -1 });
+		}
 
-		PHYSFS_seek(handle, offset);
-		surfaces.push_back(surface);
+		surfaces.push_back(std::move(surface));
+		start += h.end_offset;
 	}
 
-	PHYSFS_close(handle);
-
-	model = Model{ surfaces };
+	model = Model{ std::move(surfaces), std::vector<MD3Frame>(frames, frames + header->num_frames),
+		std::vector<MD3Tag>(tags, tags + tag_total), header->num_tags };
 	return true;
 }
 
-void Model::LoadSurfaceAssets()
+int Model::FindTag(const std::string& name) const
 {
-	// load the textures for each surface.
-	// load the texture file
-	for (auto surface : surfaces)
+	for (int i = 0; i < tag_count && i < (int)tags.size(); ++i)
 	{
-		for (auto shader : surface.shaders)
-		{
-			std::string file = shader.name;
-			std::string path = "/data/" + file;
+		if (strncmp(tags[i].name, name.c_str(), MAX_QPATH) == 0)
+			return i;
+	}
+	return -1;
+}
 
-			auto handle = PHYSFS_openRead(path.c_str());
-			if (handle != NULL)
+const glm::vec3* MD3Loader::NormalTable()
+{
+	// every packed normal decoded once, rather than two sines and two cosines per vertex
+	static const std::vector<glm::vec3> table = [] {
+		std::vector<glm::vec3> normals(65536);
+		for (int lat = 0; lat < 256; ++lat)
+		{
+			for (int lng = 0; lng < 256; ++lng)
 			{
-				int length = PHYSFS_fileLength(handle);
-
-				unsigned char* tex_data = new unsigned char[length];
-
-				PHYSFS_readBytes(handle, &tex_data[0], length);
-				PHYSFS_close(handle);
-
-				shader.texId = SOIL_load_OGL_texture_from_memory(tex_data, length, 3, 0, SOIL_FLAG_POWER_OF_TWO | SOIL_FLAG_MIPMAPS | SOIL_FLAG_TEXTURE_REPEATS);
-				delete[] tex_data;
-				tex_data = nullptr;
+				float a = lat * MD3_BYTE_ANGLE;
+				float b = lng * MD3_BYTE_ANGLE;
+				normals[(lat << 8) | lng] = glm::vec3(cosf(a) * sinf(b), sinf(a) * sinf(b), cosf(b));
 			}
 		}
-	}
+		return normals;
+	}();
+
+	return &table[0];
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <utility>
 #include <vector>
 #include <glm/glm.hpp>
 
@@ -8,10 +9,14 @@ const int MAX_QPATH = 64;
 const int MD3_MAX_FRAMES = 1024;
 const int MD3_MAX_TAGS = 16;
 const int MD3_MAX_SURFACES = 32;
+// vertex positions are stored in 64ths of a unit
+const float MD3_XYZ_SCALE = 1.f / 64;
+// normals are packed as a latitude and longitude byte, this is one step of either
+const float MD3_BYTE_ANGLE = 6.28318531f / 256;
 
 struct MD3Vertex {
-	glm::u8vec3 vert;
-	short normal;
+	glm::i16vec3 vert;
+	short normal;	// latitude in the high byte, longitude in the low one, 256 steps a turn
 };
 
 struct MD3TexCoord {
@@ -43,7 +48,7 @@ struct MD3SurfaceHeader {
 	int end_offset;
 };
 
-struct Shader {
+struct SurfaceShader {
 	std::string name;
 	int index;
 	int texId;
@@ -51,16 +56,19 @@ struct Shader {
 
 struct Surface {
 	MD3SurfaceHeader header;
-	std::vector<Shader> shaders;
+	std::vector<SurfaceShader> shaders;
 	std::vector<MD3Triangle> triangles;
 	std::vector<MD3TexCoord> texcoords;
+	// every frame as it's stored in the file, num_verts vertices per frame
 	std::vector<MD3Vertex> vertices;
+
+	const MD3Vertex* Frame(int frame) const { return &vertices[frame * header.num_verts]; }
 };
 
 struct MD3Tag {
 	char name[MAX_QPATH];
 	glm::vec3 origin;
-	glm::mat3x3 axis;
+	glm::mat3x3 axis;	// forward, left and up, one per column
 };
 
 struct MD3Frame {
@@ -68,7 +76,7 @@ struct MD3Frame {
 	glm::vec3 max_bounds;
 	glm::vec3 local_origin;
 	float radius;
-	char name[MAX_QPATH];
+	char name[16];
 };
 
 struct MD3Header {
@@ -90,15 +98,32 @@ struct MD3Header {
 class Model {
 public:
 	Model() {};
-	Model(std::vector<Surface> surfs) : surfaces{ surfs } { }
-	void LoadSurfaceAssets();
-	std::vector<Surface> GetSurfaces() { return surfaces; }
+	Model(std::vector<Surface> surfs, std::vector<MD3Frame> frms, std::vector<MD3Tag> tgs, int tagsPerFrame)
+		: surfaces{ std::move(surfs) }, frames{ std::move(frms) }, tags{ std::move(tgs) }, tag_count{ tagsPerFrame } { }
+	const std::vector<Surface>& GetSurfaces() const { return surfaces; }
+	const std::vector<MD3Frame>& GetFrames() const { return frames; }
+	int FrameCount() const { return (int)frames.size(); }
+
+	// every frame's tags, TagCount() per frame
+	const std::vector<MD3Tag>& GetTags() const { return tags; }
+	int TagCount() const { return tag_count; }
+	const MD3Tag& GetTag(int frame, int tag) const { return tags[frame * tag_count + tag]; }
+	// index of the tag called name, or -1
+	int FindTag(const std::string& name) const;
 
 private:
 	std::vector<Surface> surfaces;
+	std::vector<MD3Frame> frames;
+	std::vector<MD3Tag> tags;
+	int tag_count{ 0 };
 };
 
 class MD3Loader {
 public:
 	static bool Load(Model& model, std::string filename);
+	// parses an md3 already in memory, checking every offset and count against its size
+	static bool Parse(Model& model, const unsigned char* data, size_t size);
+
+	// unit normals for all 65536 packed normals, index with the packed value as unsigned
+	static const glm::vec3* NormalTable();
 };
\ No newline at end of file
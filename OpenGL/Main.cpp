@@ -18,6 +18,12 @@
 #include "physfs/physfs.h"
 
 #include "BSPLoader.h"
+#include "CollisionModel.h"
+#include "LineOfSight.h"
+#include "ModelRenderer.h"
+#include "ProgramCache.h"
+#include "TagHierarchy.h"
+#include "TriangleBVH.h"
 
 #include "shaders.inc"
 
@@ -41,7 +47,16 @@ float lastX = ScreenWidth / 2.0f;
 float lastY = ScreenHeight / 2.0f;
 
 GLuint shaderProgram;
-int faceCount;
+GLuint modelProgram = 0;
+// scripted shader stages, a program per permutation rather than per surface
+ProgramCache stagePrograms{ stageVertexSource, stageFragmentSource };
+
+// the map's buffers, kept so the patches at the end of them can be rewritten
+GLuint bspVao = 0;
+GLuint bspVbo = 0;
+GLuint bspEbo = 0;
+size_t vboCapacity = 0;
+size_t eboCapacity = 0;
 
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 {
@@ -107,92 +122,349 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 		
 }
 
+void setVertexAttributes();
+
 void loadBSP(std::string file, BSPLoader &loader, std::vector<vertex>& vertices, std::vector<unsigned int> &elements)
 {
 	loader.SetBSPFile(file);
-	vertices = loader.get_vertex_data();
+	vertices = loader.get_render_vertices();
+
+	// the previous map's objects, deleting 0 does nothing the first time round
+	glDeleteVertexArrays(1, &bspVao);
+	glDeleteBuffers(1, &bspVbo);
+	glDeleteBuffers(1, &bspEbo);
+	glDeleteProgram(shaderProgram);
 
 	// generate and bind array and buffer objects.
-	GLuint vao;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	glGenVertexArrays(1, &bspVao);
+	glBindVertexArray(bspVao);
 
-	GLuint vbo;
-	glGenBuffers(1, &vbo);
+	glGenBuffers(1, &bspVbo);
+	glGenBuffers(1, &bspEbo);
 
-	GLuint ebo;
-	glGenBuffers(1, &ebo);
+	glBindBuffer(GL_ARRAY_BUFFER, bspVbo);
+	vboCapacity = vertices.size() * sizeof(vertex);
+	glBufferData(GL_ARRAY_BUFFER, vboCapacity, &vertices[0], GL_STATIC_DRAW);
 
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(vertex), &vertices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bspEbo);
+	elements = loader.get_render_indices();
+	eboCapacity = elements.size() * sizeof(unsigned int);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, eboCapacity, &elements[0], GL_STATIC_DRAW);
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	elements = loader.get_indices();
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements.size() * sizeof(unsigned int), &elements[0], GL_STATIC_DRAW);
+	shaderProgram = compileProgram(bspVertexSource, bspFragmentSource);
+	if (shaderProgram == 0) return;
 
-	// load and compile vertex and frag shaders
+	glUseProgram(shaderProgram);
 
-	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertexShader, 1, &bspVertexSource, NULL);
+	// textures go on unit 0, lightmaps on unit 1
+	glUniform1i(glGetUniformLocation(shaderProgram, "tex"), 0);
+	glUniform1i(glGetUniformLocation(shaderProgram, "lightmap"), 1);
+	glUniform1i(glGetUniformLocation(shaderProgram, "vertexLit"), 0);
 
-	glCompileShader(vertexShader);
+	setVertexAttributes();
+}
 
-	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragmentShader, 1, &bspFragmentSource, NULL);
+void setVertexAttributes()
+{
+	// vert shader attributes - see vertex struct in BSPLoader.h for specifics. every program
+	// that draws the map has them at the same locations.
+	glVertexAttribPointer(PositionAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), 0);
 
-	glCompileShader(fragmentShader);
+	glVertexAttribPointer(ColourAttrib, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+		sizeof(vertex), (void*)(10 * sizeof(float)));
 
-	shaderProgram = glCreateProgram();
-	glAttachShader(shaderProgram, vertexShader);
-	glAttachShader(shaderProgram, fragmentShader);
+	glVertexAttribPointer(TexcoordAttrib, 2, GL_FLOAT, GL_FALSE,
+		sizeof(vertex), (void*)(3 * sizeof(float)));
 
-	glBindFragDataLocation(shaderProgram, 0, "outColor");
+	glVertexAttribPointer(LmcoordAttrib, 2, GL_FLOAT, GL_FALSE,
+		sizeof(vertex), (void*)(5 * sizeof(float)));
 
-	glLinkProgram(shaderProgram);
+	glVertexAttribPointer(NormalAttrib, 3, GL_FLOAT, GL_FALSE,
+		sizeof(vertex), (void*)(7 * sizeof(float)));
 
-	GLint isLinked = 0;
-	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &isLinked);
+	glEnableVertexAttribArray(PositionAttrib);
+	glEnableVertexAttribArray(ColourAttrib);
+	glEnableVertexAttribArray(TexcoordAttrib);
+	glEnableVertexAttribArray(LmcoordAttrib);
+	glEnableVertexAttribArray(NormalAttrib);
+}
 
-	if (isLinked == GL_FALSE)
+// writes the end of a buffer from offset on, the part in front of it is already there. when
+// it no longer fits the buffer is replaced by a bigger one and the front copied across on the gpu.
+// returns true if the buffer was replaced.
+bool uploadTail(GLenum target, GLuint& buffer, size_t& capacity, const void* data, size_t offset, size_t size)
+{
+	bool replaced = false;
+
+	if (size > capacity)
 	{
-		GLint maxLength = 0;
-		glGetProgramiv(shaderProgram, GL_INFO_LOG_LENGTH, &maxLength);
+		size_t grown = size + size / 2;
 
-		std::vector<GLchar> infoLog(maxLength);
-		glGetProgramInfoLog(shaderProgram, maxLength, &maxLength, &infoLog[0]);
+		GLuint bigger;
+		glGenBuffers(1, &bigger);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+		glBufferData(GL_COPY_WRITE_BUFFER, grown, NULL, GL_STATIC_DRAW);
 
-		// The program is useless now. So delete it.
-		glDeleteProgram(shaderProgram);
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, offset);
 
-		// Provide the infolog in whatever manner you deem best.
-		// Exit with failure.
-		return;
+		glDeleteBuffers(1, &buffer);
+		buffer = bigger;
+		capacity = grown;
+		replaced = true;
 	}
 
-	glUseProgram(shaderProgram);
+	glBindBuffer(target, buffer);
+	if (size > offset)
+		glBufferSubData(target, offset, size - offset, (const char*)data + offset);
 
-	// vert shader attributes - see vertex struct in BSPLoader.h for specifics
-	GLint posAttrib = glGetAttribLocation(shaderProgram, "position");
-	glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(vertex), 0);
+	return replaced;
+}
 
-	GLint colAttrib = glGetAttribLocation(shaderProgram, "colour");
-	glVertexAttribPointer(colAttrib, 4, GL_UNSIGNED_BYTE, GL_TRUE,
-		sizeof(vertex), (void*)(10 * sizeof(float)));
+// re-uploads the patches after the loader has re-tessellated them, the rest of the map stays put.
+void uploadPatches(const BSPLoader& loader, std::vector<unsigned int>& elements)
+{
+	const std::vector<vertex>& vertices = loader.get_render_vertices();
+	elements = loader.get_render_indices();
+	patch_range patches = loader.get_render_patch_range();
 
-	GLint uvAttrib = glGetAttribLocation(shaderProgram, "texcoord");
-	glVertexAttribPointer(uvAttrib, 2, GL_FLOAT, GL_FALSE,
-		sizeof(vertex), (void*)(3 * sizeof(float)));
+	// the element buffer binding belongs to the vertex array
+	glBindVertexArray(bspVao);
 
-	GLint lmAttrib = glGetAttribLocation(shaderProgram, "lmcoord");
-	glVertexAttribPointer(lmAttrib, 2, GL_FLOAT, GL_FALSE,
-		sizeof(vertex), (void*)(5 * sizeof(float)));
+	if (uploadTail(GL_ARRAY_BUFFER, bspVbo, vboCapacity, vertices.data(),
+		patches.first_vertex * sizeof(vertex), vertices.size() * sizeof(vertex)))
+	{
+		// the attribute pointers still refer to the old buffer
+		setVertexAttributes();
+	}
+
+	uploadTail(GL_ELEMENT_ARRAY_BUFFER, bspEbo, eboCapacity, elements.data(),
+		patches.first_index * sizeof(unsigned int), elements.size() * sizeof(unsigned int));
+}
+
+// frustum planes in the space the matrix transforms from, with the normals facing inward.
+void extractFrustum(const glm::mat4& m, glm::vec4 planes[6])
+{
+	glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+	glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+	glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+	glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+	planes[0] = row3 + row0;
+	planes[1] = row3 - row0;
+	planes[2] = row3 + row1;
+	planes[3] = row3 - row1;
+	planes[4] = row3 + row2;
+	planes[5] = row3 - row2;
+
+	for (int i = 0; i < 6; ++i)
+		planes[i] = planes[i] * (1.f / glm::length(glm::vec3(planes[i])));
+}
+
+// the visible index ranges of the scripted surfaces, gathered while the plain ones are drawn
+// and drawn afterwards a material at a time
+struct scripted_ranges
+{
+	std::vector<int> first;	// per draw surface, into counts and offsets. -1 when none are visible
+	std::vector<int> count;
+	std::vector<GLsizei> counts;
+	std::vector<const void*> offsets;
+};
+
+// draws the visible meshlets of each surface, surfaces with none visible are skipped entirely.
+// scripted surfaces only have their ranges gathered.
+void drawVisibleSurfaces(const BSPLoader& loader, const std::vector<int>& visible, std::vector<GLsizei>& counts, std::vector<const void*>& offsets,
+	scripted_ranges& scripted)
+{
+	const MeshletSet& meshlets = loader.get_meshlets();
+	const std::vector<draw_surface>& surfaces = loader.get_draw_surfaces();
+	size_t next = 0;
+
+	scripted.first.assign(surfaces.size(), -1);
+	scripted.count.assign(surfaces.size(), 0);
+	scripted.counts.clear();
+	scripted.offsets.clear();
+
+	GLint uniVertexLit = glGetUniformLocation(shaderProgram, "vertexLit");
+	bool vertexLit = false;
+
+	for (int i = 0; i < surfaces.size(); ++i)
+	{
+		const draw_surface& surface = surfaces[i];
+		counts.clear();
+		offsets.clear();
+
+		int end = surface.first_meshlet + surface.n_meshlets;
+		int range_end = -1;
+		while (next < visible.size() && visible[next] < end)
+		{
+			const meshlet& m = meshlets.get(visible[next++]);
+
+			// neighbouring meshlets are contiguous in the index buffer so draw them as one range
+			if (m.meshvert == range_end)
+				counts.back() += m.n_meshverts;
+			else
+			{
+				counts.push_back(m.n_meshverts);
+				offsets.push_back((void*)(long)(m.meshvert * sizeof(GLuint)));
+			}
+			range_end = m.meshvert + m.n_meshverts;
+		}
+
+		if (counts.empty()) continue;
+
+		if (surface.material >= 0)
+		{
+			scripted.first[i] = (int)scripted.counts.size();
+			scripted.count[i] = (int)counts.size();
+			scripted.counts.insert(scripted.counts.end(), counts.begin(), counts.end());
+			scripted.offsets.insert(scripted.offsets.end(), offsets.begin(), offsets.end());
+			continue;
+		}
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, surface.texture);
 
-	glEnableVertexAttribArray(posAttrib);
-	glEnableVertexAttribArray(colAttrib);
-	glEnableVertexAttribArray(uvAttrib);
-	glEnableVertexAttribArray(lmAttrib);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, surface.lightmap);
 
-	faceCount = loader.get_face_count();
+		if (surface.vertex_lit != vertexLit)
+		{
+			vertexLit = surface.vertex_lit;
+			glUniform1i(uniVertexLit, vertexLit);
+		}
+
+		glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], (GLsizei)counts.size());
+	}
+
+	if (vertexLit)
+		glUniform1i(uniVertexLit, 0);
+}
+
+// draws the visible scripted surfaces a material at a time, each stage a pass over all of its
+// surfaces. the material order keeps materials that share a program together, so programs
+// change per pass at most and never per surface. opaque and blended materials are drawn by
+// separate calls, so anything else opaque can go in between.
+void drawScriptedSurfaces(const BSPLoader& loader, const scripted_ranges& scripted, bool blended, const glm::mat4& view, const glm::mat4& proj,
+	const glm::mat4& model, const glm::vec3& viewOrigin, float time, std::vector<GLsizei>& counts, std::vector<const void*>& offsets)
+{
+	const std::vector<draw_surface>& surfaces = loader.get_draw_surfaces();
+	const std::vector<material>& materials = loader.get_materials();
+
+	// every pass after the first goes over the same triangles again
+	glDepthFunc(GL_LEQUAL);
+	glActiveTexture(GL_TEXTURE0);
+
+	GLuint current = 0;
+	for (int index : loader.get_material_order())
+	{
+		const material& _material = materials[index];
+		if (_material.blended != blended) continue;
+
+		bool visible = false;
+		for (int surface : _material.surfaces)
+		{
+			if (scripted.first[surface] >= 0)
+			{
+				visible = true;
+				break;
+			}
+		}
+		if (!visible) continue;
+
+		if (_material.two_sided)
+			glDisable(GL_CULL_FACE);
+
+		for (const material_pass& pass : _material.passes)
+		{
+			const stage_program& program = stagePrograms.get(pass.key);
+			if (program.program == 0) continue;
+
+			if (program.program != current)
+			{
+				current = program.program;
+				glUseProgram(current);
+				glUniformMatrix4fv(program.view, 1, GL_FALSE, glm::value_ptr(view));
+				glUniformMatrix4fv(program.proj, 1, GL_FALSE, glm::value_ptr(proj));
+				glUniformMatrix4fv(program.model, 1, GL_FALSE, glm::value_ptr(model));
+				glUniform3fv(program.view_origin, 1, glm::value_ptr(viewOrigin));
+			}
+
+			const Stage& stage = *pass.stage;
+			stage_uniforms uniforms;
+			evaluate_stage(stage, time, uniforms);
+			glUniform4fv(program.colour, 1, glm::value_ptr(uniforms.colour));
+			glUniformMatrix3fv(program.tex_matrix, 1, GL_FALSE, glm::value_ptr(uniforms.tex_matrix));
+			glUniform2fv(program.turb, 1, glm::value_ptr(uniforms.turb));
+
+			if (stage.hasBlend)
+			{
+				glEnable(GL_BLEND);
+				glBlendFunc(stage.BlendSrc, stage.BlendDst);
+			}
+			else
+				glDisable(GL_BLEND);
+
+			// like q3, blended stages leave the depth buffer alone unless they ask
+			glDepthMask(!stage.hasBlend || stage.depthWrite ? GL_TRUE : GL_FALSE);
+
+			if (!pass.lightmap)
+			{
+				int frame = (int)(time * stage.animFrequency) % (int)pass.frames.size();
+				glBindTexture(GL_TEXTURE_2D, pass.frames[frame]);
+			}
+
+			// one draw for every surface of the material, or one per lightmap for a lightmap stage
+			counts.clear();
+			offsets.clear();
+			GLuint lightmap = 0;
+			for (int surface : _material.surfaces)
+			{
+				int first = scripted.first[surface];
+				if (first < 0) continue;
+
+				if (pass.lightmap && surfaces[surface].lightmap != lightmap)
+				{
+					if (!counts.empty())
+						glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], (GLsizei)counts.size());
+					counts.clear();
+					offsets.clear();
+
+					lightmap = surfaces[surface].lightmap;
+					glBindTexture(GL_TEXTURE_2D, lightmap);
+				}
+
+				counts.insert(counts.end(), scripted.counts.begin() + first, scripted.counts.begin() + first + scripted.count[surface]);
+				offsets.insert(offsets.end(), scripted.offsets.begin() + first, scripted.offsets.begin() + first + scripted.count[surface]);
+			}
+
+			if (!counts.empty())
+				glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], (GLsizei)counts.size());
+		}
+
+		if (_material.two_sided)
+			glEnable(GL_CULL_FACE);
+	}
+
+	glDisable(GL_BLEND);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+	glUseProgram(shaderProgram);
+}
+
+void drawModels(const ModelRenderer& models, const glm::mat4& view, const glm::mat4& proj, const glm::mat4& model)
+{
+	if (models.instance_count() == 0) return;
+
+	glUseProgram(modelProgram);
+	glUniformMatrix4fv(glGetUniformLocation(modelProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+	glUniformMatrix4fv(glGetUniformLocation(modelProgram, "proj"), 1, GL_FALSE, glm::value_ptr(proj));
+	glUniformMatrix4fv(glGetUniformLocation(modelProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
+	models.draw();
+
+	// the map's uniforms are set on whichever program is current
+	glUseProgram(shaderProgram);
+	glBindVertexArray(bspVao);
 }
 
 void mount_file_data(std::string path)
@@ -248,7 +520,7 @@ int main()
 	glfwInit();
 
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
@@ -281,13 +553,74 @@ int main()
 
 	ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
+	// misc_models have their own program, they're drawn instanced and lit by the light grid
+	modelProgram = compileProgram(modelVertexSource, modelFragmentSource);
+	if (modelProgram != 0)
+	{
+		glUseProgram(modelProgram);
+		glUniform1i(glGetUniformLocation(modelProgram, "tex"), 0);
+	}
+
 	// needs a valid Q3A BSP file.
 	BSPLoader loader{ SingleDraw };
+	CollisionModel collision;
+	trace_result aim;
+	LineOfSight sight{ collision };
+	TriangleBVH bvh;
+	ray_hit picked;
+	ModelRenderer models;
+	// the closest deathmatch spawn point to the camera, and how far away it is
+	int nearestSpawn = -1;
+	float spawnDistance = 0.f;
+	// the last benchmark results, shown in the options window
+	tessellation_benchmark tessellationBench;
+	bool tessellationBenched = false;
+	animation_benchmark animationBench;
+	bool animationBenched = false;
+	ray_benchmark rayBench;
+	bool rayBenched = false;
+	sight_stats sightStats;
+	int sightVisible = 0;
+	int sightDisagree = 0;	// pairs that came out differently the other way round
+	bool sightChecked = false;
+	std::vector<sight_query> sightQueries;
+	std::vector<unsigned char> sightAnswers;
+	// a player's legs, torso and head hung from each other's tags
+	Model tagModels[3];
+	tag_benchmark tagBench;
+	int tagParts = 0;
+	bool tagsBenched = false;
 
 	std::vector<vertex> vertices;
 	std::vector<unsigned int> elements;
+
+	std::vector<int> visible;
+	std::vector<GLsizei> drawCounts;
+	std::vector<const void*> drawOffsets;
+	scripted_ranges scripted;
 	
 	int selected_index = 0;
+	std::string openedMap;
+
+	auto openMap = [&](const std::string& fullfile) {
+		openedMap = fullfile;
+		loadBSP(fullfile, loader, vertices, elements);
+		collision.build(loader);
+		bvh.build(loader);
+
+		// every permutation the map needs is compiled now rather than the first
+		// time it comes into view
+		for (const auto& _material : loader.get_materials())
+		{
+			for (const auto& pass : _material.passes)
+				stagePrograms.get(pass.key);
+		}
+		glUseProgram(shaderProgram);
+
+		if (modelProgram != 0)
+			models.load(loader, modelProgram);
+		glBindVertexArray(bspVao);
+	};
 
 	char** map_files = PHYSFS_enumerateFiles("/data/maps");
 
@@ -321,6 +654,28 @@ int main()
 		GLint modelProj = glGetUniformLocation(shaderProgram, "model");
 		glUniformMatrix4fv(modelProj, 1, GL_FALSE, glm::value_ptr(model));
 
+		// cull meshlets in bsp space, so the planes and camera go through the model matrix too
+		if (loader.is_loaded())
+		{
+			glm::vec4 planes[6];
+			extractFrustum(proj * view * model, planes);
+			glm::vec3 bspCamera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPos, 1.0f));
+			loader.get_meshlets().cull(planes, bspCamera, visible);
+			models.select_lods(bspCamera, proj[1][1]);
+
+			// what the camera is looking at, a point trace against anything solid
+			glm::vec3 bspFront = glm::vec3(glm::inverse(model) * glm::vec4(cameraFront, 0.0f));
+			aim = collision.trace(bspCamera, bspCamera + bspFront * 8192.f, glm::vec3(0.f), glm::vec3(0.f),
+				CONTENTS_SOLID | CONTENTS_PLAYERCLIP);
+			picked = bvh.intersect(bspCamera, bspFront, 8192.f);
+
+			const EntityStore& entities = loader.get_entities();
+			int spawnClass = entities.find_classname("info_player_deathmatch");
+			nearestSpawn = spawnClass >= 0 ? entities.nearest(bspCamera, spawnClass) : -1;
+			if (nearestSpawn >= 0)
+				spawnDistance = glm::length(entities.get(nearestSpawn).origin - bspCamera);
+		}
+
 		if (!AllowMouse)
 		{
 			ImGui::Begin("Options");
@@ -328,6 +683,135 @@ int main()
 			{
 				fileDialog.Open();
 			}
+			if (loader.is_loaded())
+			{
+				cache_stats stats = loader.get_cache_stats();
+				ImGui::Text("ACMR: %.3f -> %.3f", stats.acmr_before, stats.acmr_after);
+				weld_stats welded = loader.get_weld_stats();
+				ImGui::Text("Vertices: %d -> %d", welded.vertices_before, welded.vertices_after);
+				// welding happens as the map loads, so a new tolerance loads it again
+				weld_settings weld = loader.get_weld_settings();
+				if (ImGui::SliderFloat("Weld Distance", &weld.position_epsilon, 0.f, 1.f, "%.3f"))
+					loader.set_weld_settings(weld);
+				if (ImGui::IsItemDeactivatedAfterEdit())
+					openMap(openedMap);
+				ImGui::Text("Meshlets: %d / %d", (int)visible.size(), loader.get_meshlets().size());
+				ImGui::Text("Looking at: %.0f units, contents 0x%x", aim.fraction * 8192.f, aim.contents);
+				if (picked.hit() && picked.instance >= 0)
+					ImGui::Text("Picked: model %d, %s", picked.instance, loader.get_shader(picked.shader).name.c_str());
+				else if (picked.hit())
+					ImGui::Text("Picked: face %d, %s", picked.face, loader.get_shader(picked.shader).name.c_str());
+				ImGui::Text("Models: %d placed, %d md3s, %d vertices", (int)loader.get_model_instances().size(),
+					(int)loader.get_model_meshes().size(), (int)loader.get_model_vertices().size());
+				ImGui::Text("Entities: %d, %d classes", loader.get_entities().size(), loader.get_entities().classname_count());
+				if (nearestSpawn >= 0)
+					ImGui::Text("Nearest spawn: entity %d, %.0f units", nearestSpawn, spawnDistance);
+				ImGui::Text("Scripted shaders: %d, %d stage programs", (int)loader.get_materials().size(), stagePrograms.size());
+				model_cache_stats cached = loader.get_model_cache_stats();
+				ImGui::Text("Model cache: %d held, %d parsed, %d reused", cached.models, cached.parsed, cached.reused);
+				model_lod_stats lods = models.get_lod_stats();
+				ImGui::Text("Model LODs: %d / %d / %d placed, %d / %d / %d triangles", lods.instances[0], lods.instances[1],
+					lods.instances[2], lods.triangles[0], lods.triangles[1], lods.triangles[2]);
+				model_lod_settings lodSettings = models.get_lod_settings();
+				if (ImGui::SliderFloat("Model LOD Scale", &lodSettings.scale, 0.5f, 20.f, "%.1f"))
+					models.set_lod_settings(lodSettings);
+				tessellation_settings tessellation = loader.get_tessellation_settings();
+				bool changed = ImGui::SliderFloat("Patch Error", &tessellation.max_error, 0.25f, 32.f, "%.2f", ImGuiSliderFlags_Logarithmic);
+				changed |= ImGui::SliderInt("Patch Max Level", &tessellation.max_level, tessellation.min_level, 32);
+				if (changed)
+				{
+					loader.set_tessellation_settings(tessellation);
+					uploadPatches(loader, elements);
+					bvh.build(loader);
+				}
+				if (ImGui::Button("Benchmark Tessellation"))
+				{
+					tessellationBench = loader.benchmark_tessellation(20);
+					tessellationBenched = true;
+				}
+				if (tessellationBenched)
+				{
+					ImGui::Text("Tessellation %s: %d vertices, reference %.1f M/s, kernel %.1f M/s", tessellationBench.passed ? "passed" : "FAILED",
+						tessellationBench.vertices, tessellationBench.reference_rate / 1e6, tessellationBench.kernel_rate / 1e6);
+					ImGui::Text("  max error %g, colour error %d, %d not bit identical, %d asymmetric", tessellationBench.max_error,
+						tessellationBench.colour_error, tessellationBench.mismatches, tessellationBench.asymmetric);
+				}
+				if (ImGui::Button("Line of Sight to Entities"))
+				{
+					// the camera against every placed entity, then each pair again the other way
+					// round, which the cache should answer the same without tracing
+					glm::vec3 bspCamera = glm::vec3(glm::inverse(model) * glm::vec4(cameraPos, 1.0f));
+					const EntityStore& entities = loader.get_entities();
+					sightQueries.clear();
+					for (int i = 0; i < entities.size(); ++i)
+					{
+						if (entities.get(i).has_origin)
+							sightQueries.push_back(sight_query{ bspCamera, entities.get(i).origin });
+					}
+					int count = (int)sightQueries.size();
+					for (int i = 0; i < count; ++i)
+						sightQueries.push_back(sight_query{ sightQueries[i].to, sightQueries[i].from });
+
+					sightAnswers.resize(sightQueries.size());
+					sight.begin_tick();
+					sight.test(sightQueries.data(), count, sightAnswers.data());
+					sight.test(sightQueries.data() + count, count, sightAnswers.data() + count);
+					sightStats = sight.get_stats();
+
+					sightVisible = 0;
+					sightDisagree = 0;
+					for (int i = 0; i < count; ++i)
+					{
+						sightVisible += sightAnswers[i];
+						if (sightAnswers[i] != sightAnswers[count + i]) sightDisagree++;
+					}
+					sightChecked = true;
+				}
+				if (sightChecked)
+				{
+					ImGui::Text("Line of sight: %d / %d visible, %d pvs rejected, %d cached, %d traced, %d disagree",
+						sightVisible, sightStats.queries / 2, sightStats.pvs_rejected, sightStats.cached, sightStats.traced, sightDisagree);
+				}
+				if (ImGui::Button("Benchmark Tags"))
+				{
+					TagHierarchy player;
+					const char* parts[] = { "lower", "upper", "head" };
+					const char* tags[] = { "", "tag_torso", "tag_head" };
+					for (int i = 0; i < 3; ++i)
+					{
+						if (!MD3Loader::Load(tagModels[i], std::string("/data/models/players/sarge/") + parts[i] + ".md3")) break;
+						if (player.add_part(&tagModels[i], i - 1, tags[i]) < 0) break;
+					}
+					tagParts = player.part_count();
+					tagBench = player.benchmark(1024, 20);
+					tagsBenched = true;
+				}
+				if (tagsBenched)
+				{
+					ImGui::Text("Tags %s: %d parts, %d transforms, %.1f M/s, max error %g", tagBench.passed ? "passed" : "FAILED",
+						tagParts, tagBench.transforms, tagBench.rate / 1e6, tagBench.max_error);
+				}
+				if (ImGui::Button("Benchmark Animation"))
+				{
+					animationBench = loader.benchmark_animation(200);
+					animationBenched = true;
+				}
+				if (animationBenched)
+				{
+					ImGui::Text("Animation %s: %d vertices, reference %.1f M/s, kernel %.1f M/s, max error %g", animationBench.passed ? "passed" : "FAILED",
+						animationBench.vertices, animationBench.reference_rate / 1e6, animationBench.kernel_rate / 1e6, animationBench.max_error);
+				}
+				if (ImGui::Button("Benchmark Rays"))
+				{
+					rayBench = bvh.benchmark(20000);
+					rayBenched = true;
+				}
+				if (rayBenched)
+				{
+					ImGui::Text("Rays %s: %d rays, %d hits, single %.1f M/s, packets of %d %.1f M/s, %d mismatches", rayBench.mismatches == 0 ? "passed" : "FAILED",
+						rayBench.rays, rayBench.hits, rayBench.single_rate / 1e6, RayPacketSize, rayBench.packet_rate / 1e6, rayBench.mismatches);
+				}
+			}
 			if (ImGui::BeginListBox("BSP Files", ImVec2(-FLT_MIN, -FLT_MIN)))
 			{
 				char** i;
@@ -343,8 +827,7 @@ int main()
 						if (ImGui::Selectable(file.c_str(), is_selected))
 						{
 							selected_index = count;
-							loadBSP(fullfile, loader, vertices, elements);
-							faceCount = loader.get_face_count();
+							openMap(fullfile);
 						}
 
 						if (is_selected)
@@ -363,6 +846,7 @@ int main()
 		{
 			mount_file_data(fileDialog.GetSelected().string() + "/");
 			map_files = PHYSFS_enumerateFiles("/data/maps");
+			loader.reload_shader_scripts();
 			fileDialog.ClearSelected();
 		}
 
@@ -377,30 +861,16 @@ int main()
 			{
 				// render each face individually - this currently leads to holes in the mesh
 				// but is probably the necessary approach to correctly render lightmaps + textures.
-				for (int i = 0; i < faceCount; ++i)
-				{
-					face _face = loader.get_face(i);
-					if (_face.type != FaceTypes::Billboard)
-					{
-						int lm = _face.lm_index;
-						shader _shader = loader.get_shader(_face.texture);
-						if (!_shader.render || _shader.transparent) continue; // don't render transparent surfaces yet!
-						if (lm < 0) lm = loader.get_default_lightmap(); // right now, we'll assign a "default" lightmap to a surface without a valid index.
-
-						if (_face.effect >= 0)
-							continue;
-
-						GLuint texId = loader.get_lightmap_tex(lm);
+				// the loader has already dropped everything that isn't drawn.
+				drawVisibleSurfaces(loader, visible, drawCounts, drawOffsets, scripted);
 
-						glActiveTexture(GL_TEXTURE0);
-						glBindTexture(GL_TEXTURE_2D, _shader.id);
+				glm::vec3 viewOrigin = glm::vec3(glm::inverse(model) * glm::vec4(cameraPos, 1.0f));
+				float time = (float)glfwGetTime();
+				drawScriptedSurfaces(loader, scripted, false, view, proj, model, viewOrigin, time, drawCounts, drawOffsets);
 
-						glActiveTexture(GL_TEXTURE1);
-						glBindTexture(GL_TEXTURE_2D, texId);
-
-						glDrawElements(GL_TRIANGLES, _face.n_meshverts, GL_UNSIGNED_INT, (void*)(long)(_face.meshvert * sizeof(GLuint)));
-					}
-				}
+				// models are opaque, blended stages don't write depth so they have to come after them
+				drawModels(models, view, proj, model);
+				drawScriptedSurfaces(loader, scripted, true, view, proj, model, viewOrigin, time, drawCounts, drawOffsets);
 			}
 			else
 			{
@@ -408,6 +878,8 @@ int main()
 				glBindTexture(GL_TEXTURE_2D, loader.get_lm_id());
 				// just draw everything in one fell swoop - all renders correctly, but can't easily do lightmaps this way!
 				glDrawElements(GL_TRIANGLES, elements.size(), GL_UNSIGNED_INT, 0);
+
+				drawModels(models, view, proj, model);
 			}
 		}
 
@@ -0,0 +1,318 @@
+#include "MeshOptimizer.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// forsyth scoring constants, see https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+const float CacheDecayPower = 1.5f;
+const float LastTriScore = 0.75f;
+const float ValenceBoostScale = 2.0f;
+const float ValenceBoostPower = 0.5f;
+
+static float vertex_score(int cache_position, unsigned int remaining)
+{
+	// no triangles left to use this vertex, never pick it
+	if (remaining == 0)
+		return -1.f;
+
+	float score = 0.f;
+
+	if (cache_position >= 0)
+	{
+		// the vertices of the last triangle get a fixed score so we don't favour any one of them
+		if (cache_position < 3)
+			score = LastTriScore;
+		else
+		{
+			const float scaler = 1.f / (VertexCacheSize - 3);
+			score = powf(1.f - (cache_position - 3) * scaler, CacheDecayPower);
+		}
+	}
+
+	// boost vertices with few triangles left so lone triangles don't get stranded
+	score += ValenceBoostScale * powf((float)remaining, -ValenceBoostPower);
+
+	return score;
+}
+
+void MeshOptimizer::optimize_vertex_cache(unsigned int* indices, size_t index_count, size_t vertex_count)
+{
+	size_t tri_count = index_count / 3;
+	if (tri_count < 2) return;
+
+	// build vertex -> triangle adjacency
+	std::vector<unsigned int> remaining(vertex_count, 0);
+	for (size_t i = 0; i < tri_count * 3; ++i)
+		remaining[indices[i]]++;
+
+	std::vector<unsigned int> adj_offset(vertex_count + 1, 0);
+	for (size_t v = 0; v < vertex_count; ++v)
+		adj_offset[v + 1] = adj_offset[v] + remaining[v];
+
+	std::vector<unsigned int> adj(tri_count * 3);
+	std::vector<unsigned int> fill(adj_offset.begin(), adj_offset.end() - 1);
+	for (size_t t = 0; t < tri_count; ++t)
+	{
+		for (int k = 0; k < 3; ++k)
+			adj[fill[indices[t * 3 + k]]++] = (unsigned int)t;
+	}
+
+	std::vector<int> cache_pos(vertex_count, -1);
+	std::vector<float> v_score(vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v)
+		v_score[v] = vertex_score(-1, remaining[v]);
+
+	std::vector<bool> emitted(tri_count, false);
+
+	std::vector<unsigned int> result(tri_count * 3);
+
+	// cache holds the lru order, with room for the three vertices pushed in by a new triangle
+	unsigned int cache[VertexCacheSize + 3];
+	unsigned int new_cache[VertexCacheSize + 3];
+	int cache_count = 0;
+
+	size_t input_cursor = 0;
+	int best = -1;
+
+	for (size_t out = 0; out < tri_count; ++out)
+	{
+		// nothing useful in the cache, fall back to the next unused triangle in input order
+		if (best < 0)
+		{
+			while (emitted[input_cursor]) ++input_cursor;
+			best = (int)input_cursor;
+		}
+
+		const unsigned int* tri = &indices[best * 3];
+		result[out * 3 + 0] = tri[0];
+		result[out * 3 + 1] = tri[1];
+		result[out * 3 + 2] = tri[2];
+		emitted[best] = true;
+
+		// detach the triangle from its vertices
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = tri[k];
+			unsigned int* begin = &adj[adj_offset[v]];
+			unsigned int* end = begin + remaining[v];
+			unsigned int* it = std::find(begin, end, (unsigned int)best);
+			if (it != end)
+			{
+				*it = *(end - 1);
+				remaining[v]--;
+			}
+		}
+
+		// move the triangle's vertices to the front of the lru cache
+		int new_count = 0;
+		new_cache[new_count++] = tri[0];
+		new_cache[new_count++] = tri[1];
+		new_cache[new_count++] = tri[2];
+		for (int c = 0; c < cache_count; ++c)
+		{
+			unsigned int v = cache[c];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				new_cache[new_count++] = v;
+		}
+
+		// anything pushed past the end of the cache loses its position score
+		for (int c = VertexCacheSize; c < new_count; ++c)
+		{
+			cache_pos[new_cache[c]] = -1;
+			v_score[new_cache[c]] = vertex_score(-1, remaining[new_cache[c]]);
+		}
+
+		cache_count = std::min(new_count, VertexCacheSize);
+		for (int c = 0; c < cache_count; ++c)
+		{
+			unsigned int v = new_cache[c];
+			cache[c] = v;
+			cache_pos[v] = c;
+			v_score[v] = vertex_score(c, remaining[v]);
+		}
+
+		// rescore triangles touching the cache and pick the best one
+		best = -1;
+		float best_score = -1.f;
+		for (int c = 0; c < cache_count; ++c)
+		{
+			unsigned int v = cache[c];
+			for (unsigned int a = 0; a < remaining[v]; ++a)
+			{
+				unsigned int t = adj[adj_offset[v] + a];
+				const unsigned int* other = &indices[t * 3];
+				float score = v_score[other[0]] + v_score[other[1]] + v_score[other[2]];
+
+				if (score > best_score)
+				{
+					best_score = score;
+					best = (int)t;
+				}
+			}
+		}
+	}
+
+	std::copy(result.begin(), result.end(), indices);
+}
+
+void MeshOptimizer::optimize_overdraw(unsigned int* indices, size_t index_count, const float* positions, size_t vertex_count, size_t stride)
+{
+	size_t tri_count = index_count / 3;
+	if (tri_count < 2) return;
+
+	auto position = [&](unsigned int v) {
+		return (const float*)((const char*)positions + v * stride);
+	};
+
+	// split the list into clusters wherever the cache optimiser had to start over, i.e. a
+	// triangle that misses on all three vertices. reordering whole clusters keeps the acmr.
+	std::vector<unsigned int> cluster_start;
+	std::vector<unsigned int> timestamps(vertex_count, 0);
+	unsigned int timestamp = FifoCacheSize + 1;
+
+	for (size_t t = 0; t < tri_count; ++t)
+	{
+		int misses = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[t * 3 + k];
+			if (timestamp - timestamps[v] > FifoCacheSize)
+			{
+				timestamps[v] = timestamp++;
+				misses++;
+			}
+		}
+
+		if (t == 0 || misses == 3)
+			cluster_start.push_back((unsigned int)t);
+	}
+
+	size_t cluster_count = cluster_start.size();
+	if (cluster_count < 2) return;
+	cluster_start.push_back((unsigned int)tri_count);
+
+	// area weighted centroid of the whole batch
+	float mesh_centroid[3] = { 0, 0, 0 };
+	float mesh_area = 0;
+
+	std::vector<float> cluster_data(cluster_count * 6, 0.f);	// centroid xyz, normal xyz
+
+	for (size_t c = 0; c < cluster_count; ++c)
+	{
+		float* centroid = &cluster_data[c * 6];
+		float* normal = &cluster_data[c * 6 + 3];
+		float cluster_area = 0;
+
+		for (unsigned int t = cluster_start[c]; t < cluster_start[c + 1]; ++t)
+		{
+			const float* p0 = position(indices[t * 3 + 0]);
+			const float* p1 = position(indices[t * 3 + 1]);
+			const float* p2 = position(indices[t * 3 + 2]);
+
+			float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+			float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+			float n[3] = {
+				e1[1] * e2[2] - e1[2] * e2[1],
+				e1[2] * e2[0] - e1[0] * e2[2],
+				e1[0] * e2[1] - e1[1] * e2[0]
+			};
+			float area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+			for (int k = 0; k < 3; ++k)
+			{
+				float mid = (p0[k] + p1[k] + p2[k]) / 3.f;
+				centroid[k] += mid * area;
+				mesh_centroid[k] += mid * area;
+				normal[k] += n[k];
+			}
+			cluster_area += area;
+		}
+
+		mesh_area += cluster_area;
+		if (cluster_area > 0)
+		{
+			for (int k = 0; k < 3; ++k) centroid[k] /= cluster_area;
+		}
+
+		float len = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+		if (len > 0)
+		{
+			for (int k = 0; k < 3; ++k) normal[k] /= len;
+		}
+	}
+
+	if (mesh_area > 0)
+	{
+		for (int k = 0; k < 3; ++k) mesh_centroid[k] /= mesh_area;
+	}
+
+	// clusters facing away from the middle of the batch are the likely occluders, draw them first
+	std::vector<float> sort_key(cluster_count);
+	std::vector<unsigned int> order(cluster_count);
+	for (size_t c = 0; c < cluster_count; ++c)
+	{
+		const float* centroid = &cluster_data[c * 6];
+		const float* normal = &cluster_data[c * 6 + 3];
+		sort_key[c] = (centroid[0] - mesh_centroid[0]) * normal[0] +
+			(centroid[1] - mesh_centroid[1]) * normal[1] +
+			(centroid[2] - mesh_centroid[2]) * normal[2];
+		order[c] = (unsigned int)c;
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		return sort_key[a] > sort_key[b];
+	});
+
+	std::vector<unsigned int> result;
+	result.reserve(tri_count * 3);
+	for (unsigned int c : order)
+	{
+		result.insert(result.end(), indices + cluster_start[c] * 3, indices + cluster_start[c + 1] * 3);
+	}
+
+	std::copy(result.begin(), result.end(), indices);
+}
+
+size_t MeshOptimizer::optimize_vertex_fetch_remap(unsigned int* remap, const unsigned int* indices, size_t index_count, size_t vertex_count)
+{
+	const unsigned int unused = ~0u;
+	std::fill(remap, remap + vertex_count, unused);
+
+	unsigned int next = 0;
+	for (size_t i = 0; i < index_count; ++i)
+	{
+		unsigned int v = indices[i];
+		if (remap[v] == unused)
+			remap[v] = next++;
+	}
+
+	size_t referenced = next;
+
+	for (size_t v = 0; v < vertex_count; ++v)
+	{
+		if (remap[v] == unused)
+			remap[v] = next++;
+	}
+
+	return referenced;
+}
+
+size_t MeshOptimizer::count_cache_misses(const unsigned int* indices, size_t index_count, size_t vertex_count, int cache_size)
+{
+	std::vector<unsigned int> timestamps(vertex_count, 0);
+	unsigned int timestamp = cache_size + 1;
+	size_t misses = 0;
+
+	for (size_t i = 0; i < index_count; ++i)
+	{
+		unsigned int v = indices[i];
+		if (timestamp - timestamps[v] > (unsigned int)cache_size)
+		{
+			timestamps[v] = timestamp++;
+			misses++;
+		}
+	}
+
+	return misses;
+}
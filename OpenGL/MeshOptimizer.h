@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+
+// index buffer optimisation for a single draw batch.
+// every function works on batch-local indices (0 .. vertex_count - 1) so the caller
+// is responsible for rebasing the batch before and after.
+
+const int VertexCacheSize = 32;	// cache size the forsyth scoring is tuned for
+const int FifoCacheSize = 16;	// cache size used when measuring acmr
+
+class MeshOptimizer
+{
+public:
+	// reorder triangles for post-transform cache locality (tom forsyth's linear-speed algorithm).
+	static void optimize_vertex_cache(unsigned int* indices, size_t index_count, size_t vertex_count);
+
+	// reorder clusters of the cache optimised triangle list so outward facing clusters are drawn first.
+	// expects the output of optimize_vertex_cache, positions are float3 at the given byte stride.
+	static void optimize_overdraw(unsigned int* indices, size_t index_count, const float* positions, size_t vertex_count, size_t stride);
+
+	// build a remap table that orders vertices by first use. unreferenced vertices are moved
+	// to the end, keeping their relative order. returns the number of referenced vertices.
+	static size_t optimize_vertex_fetch_remap(unsigned int* remap, const unsigned int* indices, size_t index_count, size_t vertex_count);
+
+	// number of fifo cache misses when drawing the list, acmr is misses / triangle count.
+	static size_t count_cache_misses(const unsigned int* indices, size_t index_count, size_t vertex_count, int cache_size = FifoCacheSize);
+};
@@ -0,0 +1,250 @@
+#include "Meshlet.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Simd.h"
+
+// cone cutoff for meshlets whose normals spread too far to ever be entirely back facing
+const float NoConeCutoff = 2.f;
+
+void MeshletSet::clear()
+{
+	truncate(0);
+}
+
+void MeshletSet::truncate(int count)
+{
+	meshlets.resize(count);
+	center_x.resize(count);
+	center_y.resize(count);
+	center_z.resize(count);
+	radius.resize(count);
+	apex_x.resize(count);
+	apex_y.resize(count);
+	apex_z.resize(count);
+	axis_x.resize(count);
+	axis_y.resize(count);
+	axis_z.resize(count);
+	cutoff.resize(count);
+}
+
+int MeshletSet::add_surface(const unsigned int* indices, int meshvert, int n_meshverts,
+	const float* positions, const float* normals, size_t stride, bool two_sided)
+{
+	int first = (int)meshlets.size();
+
+	unsigned int used[MeshletMaxVertices];
+	int used_count = 0;
+	int start = meshvert;
+
+	for (int t = meshvert; t + 2 < meshvert + n_meshverts; t += 3)
+	{
+		// count the vertices this triangle would add
+		int extra = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[t + k];
+			bool found = false;
+			for (int u = 0; u < used_count && !found; ++u)
+				found = used[u] == v;
+			for (int p = 0; p < k && !found; ++p)
+				found = indices[t + p] == v;
+			if (!found) extra++;
+		}
+
+		int triangles = (t - start) / 3;
+		if (used_count + extra > MeshletMaxVertices || triangles + 1 > MeshletMaxTriangles)
+		{
+			add_meshlet(indices, start, t - start, positions, normals, stride, two_sided);
+			start = t;
+			used_count = 0;
+		}
+
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[t + k];
+			bool found = false;
+			for (int u = 0; u < used_count && !found; ++u)
+				found = used[u] == v;
+			if (!found) used[used_count++] = v;
+		}
+	}
+
+	if (start < meshvert + n_meshverts)
+		add_meshlet(indices, start, meshvert + n_meshverts - start, positions, normals, stride, two_sided);
+
+	return first;
+}
+
+void MeshletSet::add_meshlet(const unsigned int* indices, int meshvert, int n_meshverts,
+	const float* positions, const float* normals, size_t stride, bool two_sided)
+{
+	auto position = [&](unsigned int v) {
+		const float* p = (const float*)((const char*)positions + v * stride);
+		return glm::vec3(p[0], p[1], p[2]);
+	};
+	auto normal = [&](unsigned int v) {
+		const float* n = (const float*)((const char*)normals + v * stride);
+		return glm::vec3(n[0], n[1], n[2]);
+	};
+
+	glm::vec3 mins = position(indices[meshvert]);
+	glm::vec3 maxs = mins;
+
+	for (int i = 0; i < n_meshverts; ++i)
+	{
+		glm::vec3 p = position(indices[meshvert + i]);
+		mins = glm::min(mins, p);
+		maxs = glm::max(maxs, p);
+	}
+
+	glm::vec3 center = (mins + maxs) * 0.5f;
+	float r = 0.f;
+	for (int i = 0; i < n_meshverts; ++i)
+	{
+		r = std::max(r, glm::length(position(indices[meshvert + i]) - center));
+	}
+
+	// geometric triangle normals, flipped to agree with the vertex normals so the result
+	// doesn't depend on winding.
+	std::vector<glm::vec3> tri_normals;
+	std::vector<glm::vec3> tri_points;
+	glm::vec3 axis(0.f);
+	for (int t = meshvert; t + 2 < meshvert + n_meshverts; t += 3)
+	{
+		glm::vec3 p0 = position(indices[t]);
+		glm::vec3 n = glm::cross(position(indices[t + 1]) - p0, position(indices[t + 2]) - p0);
+		float len = glm::length(n);
+		if (len <= 0.f) continue;
+
+		n = n / len;
+		glm::vec3 shading = normal(indices[t]) + normal(indices[t + 1]) + normal(indices[t + 2]);
+		if (glm::dot(n, shading) < 0.f) n = -n;
+
+		tri_normals.push_back(n);
+		tri_points.push_back(p0);
+		axis += n;
+	}
+
+	// the whole meshlet faces away from the camera when every triangle does. with a cone of
+	// half angle a around the axis and an apex behind every triangle's plane, that holds when
+	// the direction from the camera to the apex is within 90 - a degrees of the axis:
+	// dot(apex - cam, axis) > sin(a) * |apex - cam|.
+	float cone_cutoff = NoConeCutoff;
+	glm::vec3 apex = center;
+	float axis_len = glm::length(axis);
+	if (axis_len > 0.f && !two_sided)
+	{
+		axis = axis / axis_len;
+
+		float min_dot = 1.f;
+		for (auto& n : tri_normals)
+			min_dot = std::min(min_dot, glm::dot(axis, n));
+
+		if (min_dot > 0.f)
+		{
+			cone_cutoff = sqrtf(1.f - min_dot * min_dot);
+
+			// slide the apex back along the axis until it is behind all of the triangles
+			float max_t = 0.f;
+			for (int t = 0; t < tri_normals.size(); ++t)
+			{
+				float t_plane = glm::dot(center - tri_points[t], tri_normals[t]) / glm::dot(axis, tri_normals[t]);
+				max_t = std::max(max_t, t_plane);
+			}
+			apex = center - axis * max_t;
+		}
+	}
+
+	unsigned int unique[MeshletMaxVertices];
+	int unique_count = 0;
+	for (int i = 0; i < n_meshverts; ++i)
+	{
+		unsigned int v = indices[meshvert + i];
+		bool found = false;
+		for (int u = 0; u < unique_count && !found; ++u)
+			found = unique[u] == v;
+		if (!found && unique_count < MeshletMaxVertices) unique[unique_count++] = v;
+	}
+
+	meshlets.push_back(meshlet{ meshvert, n_meshverts, unique_count });
+	center_x.push_back(center.x);
+	center_y.push_back(center.y);
+	center_z.push_back(center.z);
+	radius.push_back(r);
+	apex_x.push_back(apex.x);
+	apex_y.push_back(apex.y);
+	apex_z.push_back(apex.z);
+	axis_x.push_back(axis.x);
+	axis_y.push_back(axis.y);
+	axis_z.push_back(axis.z);
+	cutoff.push_back(cone_cutoff);
+}
+
+int MeshletSet::cull(const glm::vec4 planes[6], const glm::vec3& camera, std::vector<int>& visible) const
+{
+	visible.clear();
+	int count = (int)meshlets.size();
+	int i = 0;
+
+#if USE_SSE2
+	const __m128 cam_x = _mm_set1_ps(camera.x);
+	const __m128 cam_y = _mm_set1_ps(camera.y);
+	const __m128 cam_z = _mm_set1_ps(camera.z);
+	const __m128 all = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 cx = _mm_loadu_ps(&center_x[i]);
+		__m128 cy = _mm_loadu_ps(&center_y[i]);
+		__m128 cz = _mm_loadu_ps(&center_z[i]);
+		__m128 r = _mm_loadu_ps(&radius[i]);
+		__m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), r);
+
+		__m128 inside = all;
+		for (int p = 0; p < 6; ++p)
+		{
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(planes[p].x)), _mm_mul_ps(cy, _mm_set1_ps(planes[p].y))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(planes[p].z)), _mm_set1_ps(planes[p].w)));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, neg_r));
+		}
+
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(&apex_x[i]), cam_x);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(&apex_y[i]), cam_y);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(&apex_z[i]), cam_z);
+		__m128 along = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(dx, _mm_loadu_ps(&axis_x[i])),
+			_mm_mul_ps(dy, _mm_loadu_ps(&axis_y[i]))),
+			_mm_mul_ps(dz, _mm_loadu_ps(&axis_z[i])));
+		__m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+		__m128 back = _mm_cmpgt_ps(along, _mm_mul_ps(_mm_loadu_ps(&cutoff[i]), dist));
+
+		int mask = _mm_movemask_ps(_mm_andnot_ps(back, inside));
+		for (int k = 0; k < 4; ++k)
+		{
+			if (mask & (1 << k)) visible.push_back(i + k);
+		}
+	}
+#endif
+
+	for (; i < count; ++i)
+	{
+		glm::vec3 center(center_x[i], center_y[i], center_z[i]);
+
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; ++p)
+			inside = glm::dot(glm::vec3(planes[p]), center) + planes[p].w > -radius[i];
+
+		if (!inside) continue;
+
+		glm::vec3 d = glm::vec3(apex_x[i], apex_y[i], apex_z[i]) - camera;
+		float along = glm::dot(d, glm::vec3(axis_x[i], axis_y[i], axis_z[i]));
+		if (along > cutoff[i] * glm::length(d)) continue;
+
+		visible.push_back(i);
+	}
+
+	return (int)visible.size();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+const int MeshletMaxVertices = 64;
+const int MeshletMaxTriangles = 124;
+
+// a run of triangles in the render index buffer, small enough to cull on its own.
+struct meshlet
+{
+	int meshvert;		// first index in the render index buffer
+	int n_meshverts;
+	int n_vertices;		// unique vertices referenced
+};
+
+// meshlets for a set of surfaces, with the culling bounds stored SoA so they can be
+// tested four at a time.
+class MeshletSet
+{
+public:
+	void clear();
+	// drop every meshlet from count on
+	void truncate(int count);
+
+	// split one surface's triangles into meshlets, keeping the triangle order (and so the
+	// cache optimisation) intact. positions and normals are float3 at the given byte stride.
+	// a two sided surface's meshlets have no normal cone, they're never back facing.
+	// returns the index of the first meshlet added.
+	int add_surface(const unsigned int* indices, int meshvert, int n_meshverts,
+		const float* positions, const float* normals, size_t stride, bool two_sided = false);
+
+	// frustum planes are (normal, distance) with the normal facing inward. writes the
+	// indices of the surviving meshlets in increasing order and returns how many there are.
+	int cull(const glm::vec4 planes[6], const glm::vec3& camera, std::vector<int>& visible) const;
+
+	int size() const { return (int)meshlets.size(); }
+	const meshlet& get(int index) const { return meshlets[index]; }
+
+private:
+	void add_meshlet(const unsigned int* indices, int meshvert, int n_meshverts,
+		const float* positions, const float* normals, size_t stride, bool two_sided);
+
+	std::vector<meshlet> meshlets;
+
+	// bounding sphere
+	std::vector<float> center_x, center_y, center_z, radius;
+	// normal cone, see add_meshlet for the test
+	std::vector<float> apex_x, apex_y, apex_z;
+	std::vector<float> axis_x, axis_y, axis_z, cutoff;
+};
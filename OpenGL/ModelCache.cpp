@@ -0,0 +1,101 @@
+#include "ModelCache.h"
+
+#include <iostream>
+
+#include "physfs/physfs.h"
+
+const Model* ModelCache::acquire(const std::string& path)
+{
+	auto found = models.find(path);
+	if (found != models.end())
+	{
+		found->second.refs++;
+		reused++;
+		return &found->second.model;
+	}
+
+	Model model;
+	if (!MD3Loader::Load(model, "data/" + path))
+	{
+		std::cout << "ModelCache: couldn't load " << path << '\n';
+		return nullptr;
+	}
+	parsed++;
+
+	entry& added = models[path];
+	added.model = std::move(model);
+	added.refs = 1;
+	return &added.model;
+}
+
+void ModelCache::release(const std::string& path)
+{
+	auto found = models.find(path);
+	if (found != models.end() && found->second.refs > 0)
+		found->second.refs--;
+}
+
+std::string ModelCache::lod_path(const std::string& path, int level)
+{
+	if (level == 0) return path;
+
+	// models/mapobjects/tree.md3 -> models/mapobjects/tree_1.md3
+	size_t dot = path.rfind('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = path.size();
+	return path.substr(0, dot) + "_" + std::to_string(level) + path.substr(dot);
+}
+
+int ModelCache::acquire_lods(const std::string& path, const Model* lods[MaxModelLods])
+{
+	lods[0] = acquire(path);
+	if (lods[0] == nullptr) return 0;
+
+	// the chain stops at the first level that's missing
+	int count = 1;
+	for (; count < MaxModelLods; ++count)
+	{
+		std::string lod = lod_path(path, count);
+		if (models.find(lod) == models.end() && !PHYSFS_exists(("data/" + lod).c_str())) break;
+
+		lods[count] = acquire(lod);
+		if (lods[count] == nullptr) break;
+	}
+	return count;
+}
+
+void ModelCache::release_lods(const std::string& path, int count)
+{
+	for (int level = 0; level < count; ++level)
+		release(lod_path(path, level));
+}
+
+int ModelCache::purge()
+{
+	int purged = 0;
+	for (auto it = models.begin(); it != models.end();)
+	{
+		if (it->second.refs == 0)
+		{
+			it = models.erase(it);
+			purged++;
+		}
+		else
+			++it;
+	}
+	return purged;
+}
+
+model_cache_stats ModelCache::get_stats() const
+{
+	model_cache_stats stats;
+	stats.models = (int)models.size();
+	for (const auto& it : models)
+	{
+		if (it.second.refs > 0) stats.referenced++;
+	}
+	stats.parsed = parsed;
+	stats.reused = reused;
+	return stats;
+}
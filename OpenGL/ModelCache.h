@@ -0,0 +1,54 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "MD3Loader.h"
+
+// the model itself and the _1 and _2 versions q3 ships for less detail
+const int MaxModelLods = 3;
+
+struct model_cache_stats
+{
+	int models{ 0 };	// parsed models held, referenced or not
+	int referenced{ 0 };
+	int parsed{ 0 };	// md3 files read since the cache was made
+	int reused{ 0 };	// acquires answered without reading anything
+};
+
+// md3s parsed once and shared by path. whoever places a model takes a reference to it and
+// gives it back when it's done, the parsed data is never changed after loading. models with
+// no references stay until purge, so one the next map also uses isn't read again.
+class ModelCache
+{
+public:
+	// the model at a game path like "models/mapobjects/tree.md3", parsed on first use. null
+	// if it can't be read, otherwise each acquire needs a matching release.
+	const Model* acquire(const std::string& path);
+	void release(const std::string& path);
+
+	// the model and whichever of its lower detail versions exist, lods[0] being the model
+	// itself. returns how many levels there are, 0 if the model can't be read. release
+	// them with release_lods and the same count.
+	int acquire_lods(const std::string& path, const Model* lods[MaxModelLods]);
+	void release_lods(const std::string& path, int count);
+
+	// drops the models nothing refers to, returns how many went
+	int purge();
+
+	model_cache_stats get_stats() const;
+
+private:
+	static std::string lod_path(const std::string& path, int level);
+
+	struct entry
+	{
+		Model model;
+		int refs{ 0 };
+	};
+
+	// map nodes don't move, so the pointers handed out stay good until the entry is purged
+	std::map<std::string, entry> models;
+	int parsed{ 0 };
+	int reused{ 0 };
+};
@@ -0,0 +1,247 @@
+#include "ModelRenderer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+// points an attribute into the instance buffer, skipping ones the shader compiled out
+static void instance_pointer(GLint attrib, int size, size_t stride, size_t offset)
+{
+	if (attrib < 0) return;
+	glVertexAttribPointer(attrib, size, GL_FLOAT, GL_FALSE, (GLsizei)stride, (void*)offset);
+}
+
+void ModelRenderer::clear()
+{
+	if (vao != 0)
+	{
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &vbo);
+		glDeleteBuffers(1, &ebo);
+		glDeleteBuffers(1, &instance_vbo);
+	}
+
+	vao = vbo = ebo = instance_vbo = 0;
+	meshes.clear();
+	surfaces.clear();
+	instance_source.clear();
+	instance_mesh.clear();
+	instance_bounds.clear();
+	instance_lod.clear();
+	run_first.clear();
+	run_count.clear();
+	lod_stats = model_lod_stats{};
+}
+
+void ModelRenderer::load(const BSPLoader& loader, GLuint program)
+{
+	clear();
+
+	const std::vector<model_instance>& placed = loader.get_model_instances();
+	if (placed.empty()) return;
+
+	const std::vector<model_mesh>& loaded = loader.get_model_meshes();
+	for (const auto& mesh : loaded)
+	{
+		mesh_draw draw;
+		std::copy(mesh.lods, mesh.lods + MaxModelLods, draw.lods);
+		draw.lod_count = mesh.lod_count;
+		meshes.push_back(draw);
+	}
+
+	// texture ids are looked up now rather than every frame
+	for (const auto& surface : loader.get_model_surfaces())
+	{
+		shader _shader = loader.get_shader(surface.texture);
+		surfaces.push_back(surface_draw{ surface.first_index, surface.n_indices, _shader.id, _shader.render });
+	}
+
+	instance_source.resize(placed.size());
+	for (int i = 0; i < placed.size(); ++i)
+	{
+		const glm::mat4& transform = placed[i].transform;
+		instance_source[i].transform = transform;
+		// modelscale_vec can stretch a model unevenly, its normals need the inverse transpose
+		glm::mat3 normal_transform = glm::transpose(glm::inverse(glm::mat3(transform)));
+		for (int c = 0; c < 3; ++c)
+			instance_source[i].normal_transform[c] = glm::vec4(normal_transform[c], 0.f);
+		instance_source[i].ambient = glm::vec4(placed[i].light.ambient, 0.f);
+		instance_source[i].directed = glm::vec4(placed[i].light.directed, 0.f);
+		instance_source[i].direction = glm::vec4(placed[i].light.direction, 0.f);
+
+		// the radius grows with the largest scale the model is placed with
+		float scale = std::max(glm::length(glm::vec3(transform[0])),
+			std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+		instance_bounds.push_back(glm::vec4(glm::vec3(transform[3]), loaded[placed[i].mesh].radius * scale));
+		instance_mesh.push_back(placed[i].mesh);
+		instance_lod.push_back(0);
+	}
+
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	const std::vector<model_vertex>& vertices = loader.get_model_vertices();
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(model_vertex), vertices.data(), GL_STATIC_DRAW);
+
+	const std::vector<unsigned int>& indices = loader.get_model_indices();
+	glGenBuffers(1, &ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+
+	// vertex attributes - see model_vertex in BSPLoader.h
+	GLint posAttrib = glGetAttribLocation(program, "position");
+	glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(model_vertex), (void*)offsetof(model_vertex, position));
+	glEnableVertexAttribArray(posAttrib);
+
+	GLint uvAttrib = glGetAttribLocation(program, "texcoord");
+	glVertexAttribPointer(uvAttrib, 2, GL_FLOAT, GL_FALSE, sizeof(model_vertex), (void*)offsetof(model_vertex, texcoord));
+	glEnableVertexAttribArray(uvAttrib);
+
+	GLint normalAttrib = glGetAttribLocation(program, "normal");
+	if (normalAttrib >= 0)
+	{
+		glVertexAttribPointer(normalAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(model_vertex), (void*)offsetof(model_vertex, normal));
+		glEnableVertexAttribArray(normalAttrib);
+	}
+
+	// rewritten whenever instances change level
+	glGenBuffers(1, &instance_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, instance_source.size() * sizeof(instance_data), NULL, GL_DYNAMIC_DRAW);
+	upload_instances();
+
+	// a matrix attribute takes a location per column
+	transform_attrib = glGetAttribLocation(program, "instanceTransform");
+	normal_transform_attrib = glGetAttribLocation(program, "normalTransform");
+	ambient_attrib = glGetAttribLocation(program, "ambient");
+	directed_attrib = glGetAttribLocation(program, "directed");
+	direction_attrib = glGetAttribLocation(program, "lightDirection");
+
+	GLint attribs[] = { transform_attrib, transform_attrib + 1, transform_attrib + 2, transform_attrib + 3,
+		normal_transform_attrib, normal_transform_attrib + 1, normal_transform_attrib + 2,
+		ambient_attrib, directed_attrib, direction_attrib };
+	for (int i = 0; i < 10; ++i)
+	{
+		if (attribs[i] < 0 || (i < 4 && transform_attrib < 0) || (i >= 4 && i < 7 && normal_transform_attrib < 0)) continue;
+		glEnableVertexAttribArray(attribs[i]);
+		glVertexAttribDivisor(attribs[i], 1);
+	}
+
+	glBindVertexArray(0);
+}
+
+void ModelRenderer::set_instance_attributes(int first_instance) const
+{
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+
+	size_t base = first_instance * sizeof(instance_data);
+	if (transform_attrib >= 0)
+	{
+		for (int c = 0; c < 4; ++c)
+			instance_pointer(transform_attrib + c, 4, sizeof(instance_data), base + offsetof(instance_data, transform) + c * sizeof(glm::vec4));
+	}
+	if (normal_transform_attrib >= 0)
+	{
+		for (int c = 0; c < 3; ++c)
+			instance_pointer(normal_transform_attrib + c, 3, sizeof(instance_data), base + offsetof(instance_data, normal_transform) + c * sizeof(glm::vec4));
+	}
+	instance_pointer(ambient_attrib, 3, sizeof(instance_data), base + offsetof(instance_data, ambient));
+	instance_pointer(directed_attrib, 3, sizeof(instance_data), base + offsetof(instance_data, directed));
+	instance_pointer(direction_attrib, 3, sizeof(instance_data), base + offsetof(instance_data, direction));
+}
+
+void ModelRenderer::upload_instances()
+{
+	int runs = (int)meshes.size() * MaxModelLods;
+	run_first.assign(runs, 0);
+	run_count.assign(runs, 0);
+	lod_stats = model_lod_stats{};
+
+	for (int i = 0; i < instance_mesh.size(); ++i)
+	{
+		run_count[instance_mesh[i] * MaxModelLods + instance_lod[i]]++;
+
+		const model_lod& lod = meshes[instance_mesh[i]].lods[instance_lod[i]];
+		lod_stats.instances[instance_lod[i]]++;
+		lod_stats.triangles[instance_lod[i]] += lod.n_triangles;
+	}
+
+	// counting sort, each run starts where the one before it ends
+	for (int r = 1; r < runs; ++r)
+		run_first[r] = run_first[r - 1] + run_count[r - 1];
+
+	std::vector<int> next = run_first;
+	staging.resize(instance_source.size());
+	for (int i = 0; i < instance_mesh.size(); ++i)
+		staging[next[instance_mesh[i] * MaxModelLods + instance_lod[i]]++] = instance_source[i];
+
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, staging.size() * sizeof(instance_data), staging.data());
+}
+
+void ModelRenderer::select_lods(const glm::vec3& camera, float projection)
+{
+	bool changed = false;
+
+	for (int i = 0; i < instance_mesh.size(); ++i)
+	{
+		int lod_count = meshes[instance_mesh[i]].lod_count;
+		if (lod_count < 2) continue;
+
+		// the radius as a fraction of half the screen height, then q3's r_lodscale mapping to
+		// a continuous level: 0 when the model fills 1 / scale of the screen, lod_count at a point
+		glm::vec3 offset = glm::vec3(instance_bounds[i]) - camera;
+		float distance = std::max(glm::length(offset), 1.f);
+		float projected = std::min(instance_bounds[i].w * projection / distance, 1.f);
+		float level = (1.f - projected * lod_config.scale) * lod_count;
+
+		int current = instance_lod[i];
+		if (level >= current - lod_config.hysteresis && level < current + 1 + lod_config.hysteresis) continue;
+
+		int target = std::min(std::max((int)floorf(level), 0), lod_count - 1);
+		if (target != current)
+		{
+			instance_lod[i] = target;
+			changed = true;
+		}
+	}
+
+	if (changed)
+		upload_instances();
+}
+
+void ModelRenderer::draw() const
+{
+	if (vao == 0) return;
+
+	glBindVertexArray(vao);
+	glActiveTexture(GL_TEXTURE0);
+
+	for (int m = 0; m < meshes.size(); ++m)
+	{
+		for (int level = 0; level < meshes[m].lod_count; ++level)
+		{
+			int run = m * MaxModelLods + level;
+			if (run_count[run] == 0) continue;
+
+			// there's no base instance before gl 4.2, so the instance attributes are moved to
+			// this run of the buffer instead
+			set_instance_attributes(run_first[run]);
+
+			const model_lod& lod = meshes[m].lods[level];
+			for (int s = lod.first_surface; s < lod.first_surface + lod.n_surfaces; ++s)
+			{
+				const surface_draw& surface = surfaces[s];
+				if (!surface.render) continue;
+
+				glBindTexture(GL_TEXTURE_2D, surface.texture);
+				glDrawElementsInstanced(GL_TRIANGLES, surface.n_indices, GL_UNSIGNED_INT,
+					(void*)(surface.first_index * sizeof(GLuint)), run_count[run]);
+			}
+		}
+	}
+
+	glBindVertexArray(0);
+}
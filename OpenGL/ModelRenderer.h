@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "BSPLoader.h"
+
+// instances and triangles drawn at each level of detail, as of the last select_lods
+struct model_lod_stats
+{
+	int instances[MaxModelLods]{};
+	int triangles[MaxModelLods]{};
+};
+
+// how eagerly models drop detail, scale works like q3's r_lodscale. a model only changes
+// level once its size on screen is more than hysteresis of a level past the boundary, so
+// one sitting right on a boundary doesn't flicker between the two.
+struct model_lod_settings
+{
+	float scale{ 5.f };
+	float hysteresis{ 0.25f };
+};
+
+// draws a map's misc_models. each md3 is uploaded once and every placement of it comes from
+// one instanced draw per surface, with the transform and light grid sample read from a
+// per-instance buffer.
+class ModelRenderer
+{
+public:
+	// uploads the loader's models for the given model shader, attributes are found by name
+	void load(const BSPLoader& loader, GLuint program);
+	void clear();
+
+	// picks every instance's level of detail from its size on screen and regroups the
+	// instance buffer to match. camera is in map space, projection is proj[1][1] (the
+	// cotangent of half the vertical field of view).
+	void select_lods(const glm::vec3& camera, float projection);
+
+	// the program must be in use with its view, proj and model uniforms set. leaves no
+	// vertex array bound.
+	void draw() const;
+
+	int instance_count() const { return (int)instance_mesh.size(); }
+	model_lod_stats get_lod_stats() const { return lod_stats; }
+	model_lod_settings get_lod_settings() const { return lod_config; }
+	void set_lod_settings(model_lod_settings settings) { lod_config = settings; }
+
+private:
+	// what the shader reads per instance
+	struct instance_data
+	{
+		glm::mat4 transform;
+		glm::vec4 normal_transform[3];	// inverse transpose of the transform's 3x3, a column each
+		glm::vec4 ambient;
+		glm::vec4 directed;
+		glm::vec4 direction;
+	};
+
+	struct surface_draw
+	{
+		int first_index;
+		int n_indices;
+		GLuint texture;
+		bool render;
+	};
+
+	struct mesh_draw
+	{
+		model_lod lods[MaxModelLods];
+		int lod_count;
+	};
+
+	void set_instance_attributes(int first_instance) const;
+	// sorts the instances into a run per mesh and level, and uploads them in that order
+	void upload_instances();
+
+	GLuint vao{ 0 };
+	GLuint vbo{ 0 };
+	GLuint ebo{ 0 };
+	GLuint instance_vbo{ 0 };
+
+	GLint transform_attrib{ -1 };
+	GLint normal_transform_attrib{ -1 };
+	GLint ambient_attrib{ -1 };
+	GLint directed_attrib{ -1 };
+	GLint direction_attrib{ -1 };
+
+	std::vector<mesh_draw> meshes;
+	std::vector<surface_draw> surfaces;
+
+	// per instance, in the loader's order
+	std::vector<instance_data> instance_source;
+	std::vector<int> instance_mesh;
+	std::vector<glm::vec4> instance_bounds;	// origin and radius in map space
+	std::vector<int> instance_lod;
+
+	// where each mesh's instances at each level sit in the instance buffer, MaxModelLods per mesh
+	std::vector<int> run_first;
+	std::vector<int> run_count;
+	std::vector<instance_data> staging;
+
+	model_lod_settings lod_config;
+	model_lod_stats lod_stats;
+};
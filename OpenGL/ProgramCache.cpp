@@ -0,0 +1,267 @@
+#include "ProgramCache.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+GLuint compileProgram(const char* vertexSource, const char* fragmentSource)
+{
+	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vertexShader, 1, &vertexSource, NULL);
+
+	glCompileShader(vertexShader);
+
+	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+
+	glCompileShader(fragmentShader);
+
+	GLuint program = glCreateProgram();
+	glAttachShader(program, vertexShader);
+	glAttachShader(program, fragmentShader);
+
+	// names a program doesn't use are ignored, anything else it has is placed around these
+	glBindAttribLocation(program, PositionAttrib, "position");
+	glBindAttribLocation(program, ColourAttrib, "colour");
+	glBindAttribLocation(program, TexcoordAttrib, "texcoord");
+	glBindAttribLocation(program, LmcoordAttrib, "lmcoord");
+	glBindAttribLocation(program, NormalAttrib, "normal");
+	glBindFragDataLocation(program, 0, "outColor");
+
+	glLinkProgram(program);
+
+	// the program keeps what it needs once linked
+	glDeleteShader(vertexShader);
+	glDeleteShader(fragmentShader);
+
+	GLint isLinked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+
+	if (isLinked == GL_FALSE)
+	{
+		GLint maxLength = 0;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+
+		std::vector<GLchar> infoLog(maxLength + 1);
+		glGetProgramInfoLog(program, maxLength, &maxLength, &infoLog[0]);
+		std::cout << "Shader link failed: " << &infoLog[0] << '\n';
+
+		// The program is useless now. So delete it.
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+stage_key make_stage_key(const Stage& stage)
+{
+	stage_key key = 0;
+
+	// a $lightmap stage reads the lightmap coordinates whatever its tcGen says
+	if (stage.map == "$lightmap" || stage.tcGen == "lightmap")
+		key |= TcGenLightmap;
+	else if (stage.tcGen == "environment")
+		key |= TcGenEnvironment;
+
+	for (const TcMod& mod : stage.tcMods)
+	{
+		if (mod.type == TcModType::Turb)
+			key |= TcModTurb;
+	}
+
+	// the light a bsp surface has for lightingDiffuse is in its vertex colours
+	if (stage.rgb == "vertex" || stage.rgb == "exactvertex" || stage.rgb == "lightingdiffuse")
+		key |= RgbVertex;
+	else if (stage.rgb == "oneminusvertex")
+		key |= RgbOneMinusVertex;
+
+	if (stage.alpha == "vertex")
+		key |= AlphaVertex;
+	else if (stage.alpha == "oneminusvertex")
+		key |= AlphaOneMinusVertex;
+
+	if (stage.alphaFunc == "gt0")
+		key |= AlphaTestGT0;
+	else if (stage.alphaFunc == "lt128")
+		key |= AlphaTestLT128;
+	else if (stage.alphaFunc == "ge128")
+		key |= AlphaTestGE128;
+
+	return key;
+}
+
+// q3's wave tables, for x in [0, 1)
+static float wave_table(WaveFunc func, float x)
+{
+	switch (func)
+	{
+	case WaveFunc::Triangle:
+		return x < 0.25f ? 4.f * x : x < 0.75f ? 2.f - 4.f * x : 4.f * x - 4.f;
+	case WaveFunc::Square:
+		return x < 0.5f ? 1.f : -1.f;
+	case WaveFunc::Sawtooth:
+		return x;
+	case WaveFunc::InverseSawtooth:
+		return 1.f - x;
+	default:
+		return sinf(x * 6.2831853f);
+	}
+}
+
+// smooth noise in [-1, 1] along t, standing in for q3's R_NoiseGet4f
+static float noise(float t)
+{
+	auto lattice = [](int i) {
+		unsigned int h = (unsigned int)i * 374761393u;
+		h = (h ^ (h >> 13)) * 1274126177u;
+		return (float)(h & 0xffff) / 32767.5f - 1.f;
+	};
+
+	float cell = floorf(t);
+	float f = t - cell;
+	f = f * f * (3.f - 2.f * f);
+	return lattice((int)cell) * (1.f - f) + lattice((int)cell + 1) * f;
+}
+
+static float evaluate_wave(const Wave& wave, float time)
+{
+	if (wave.func == WaveFunc::Noise)
+		return wave.base + noise((time + wave.phase) * wave.frequency) * wave.amplitude;
+
+	float x = wave.phase + time * wave.frequency;
+	return wave.base + wave_table(wave.func, x - floorf(x)) * wave.amplitude;
+}
+
+// s' = a s + b t + c, t' = d s + e t + f, as a matrix that takes (s, t, 1)
+static glm::mat3 st_matrix(float a, float b, float c, float d, float e, float f)
+{
+	return glm::mat3(glm::vec3(a, d, 0.f), glm::vec3(b, e, 0.f), glm::vec3(c, f, 1.f));
+}
+
+void evaluate_stage(const Stage& stage, float time, stage_uniforms& uniforms)
+{
+	glm::vec3 rgb(1.f);
+	if (stage.rgb == "const")
+		rgb = glm::vec3(stage.rgbConst[0], stage.rgbConst[1], stage.rgbConst[2]);
+	else if (stage.rgb == "wave")
+		rgb = glm::vec3(glm::clamp(evaluate_wave(stage.rgbWave, time), 0.f, 1.f));
+
+	// the plain pass doubles the lightmap, its stages match it
+	if (stage.map == "$lightmap")
+		rgb *= 2.f;
+
+	float alpha = 1.f;
+	if (stage.alpha == "const")
+		alpha = stage.alphaConst;
+	else if (stage.alpha == "wave")
+		alpha = glm::clamp(evaluate_wave(stage.alphaWave, time), 0.f, 1.f);
+
+	uniforms.colour = glm::vec4(rgb, alpha);
+	uniforms.turb = glm::vec2(0.f);
+
+	// each tcMod works on what the ones before it made. turb is per vertex so the shader
+	// does it, ahead of the rest.
+	glm::mat3 m(1.f);
+	for (const TcMod& mod : stage.tcMods)
+	{
+		switch (mod.type)
+		{
+		case TcModType::Scroll:
+		{
+			float s = mod.params[0] * time, t = mod.params[1] * time;
+			m = st_matrix(1.f, 0.f, s - floorf(s), 0.f, 1.f, t - floorf(t)) * m;
+			break;
+		}
+		case TcModType::Scale:
+			m = st_matrix(mod.params[0], 0.f, 0.f, 0.f, mod.params[1], 0.f) * m;
+			break;
+		case TcModType::Rotate:
+		{
+			float radians = glm::radians(-mod.params[0] * time);
+			float sine = sinf(radians), cosine = cosf(radians);
+			m = st_matrix(cosine, -sine, 0.5f - 0.5f * cosine + 0.5f * sine,
+				sine, cosine, 0.5f - 0.5f * sine - 0.5f * cosine) * m;
+			break;
+		}
+		case TcModType::Stretch:
+		{
+			float wave = evaluate_wave(mod.wave, time);
+			float p = wave != 0.f ? 1.f / wave : 1.f;
+			m = st_matrix(p, 0.f, 0.5f - 0.5f * p, 0.f, p, 0.5f - 0.5f * p) * m;
+			break;
+		}
+		case TcModType::Transform:
+			m = st_matrix(mod.params[0], mod.params[2], mod.params[4], mod.params[1], mod.params[3], mod.params[5]) * m;
+			break;
+		case TcModType::Turb:
+			uniforms.turb = glm::vec2(mod.wave.phase + time * mod.wave.frequency, mod.wave.amplitude);
+			break;
+		}
+	}
+	uniforms.tex_matrix = m;
+}
+
+std::string ProgramCache::source(stage_key key, bool fragment) const
+{
+	static const struct { stage_key bit; const char* define; } defines[] = {
+		{ TcGenLightmap, "TCGEN_LIGHTMAP" },
+		{ TcGenEnvironment, "TCGEN_ENVIRONMENT" },
+		{ TcModTurb, "TCMOD_TURB" },
+		{ RgbVertex, "RGB_VERTEX" },
+		{ RgbOneMinusVertex, "RGB_ONE_MINUS_VERTEX" },
+		{ AlphaVertex, "ALPHA_VERTEX" },
+		{ AlphaOneMinusVertex, "ALPHA_ONE_MINUS_VERTEX" },
+		{ AlphaTestGT0, "ALPHA_TEST_GT0" },
+		{ AlphaTestLT128, "ALPHA_TEST_LT128" },
+		{ AlphaTestGE128, "ALPHA_TEST_GE128" },
+	};
+
+	std::string text = "#version 150 core\n";
+	for (const auto& define : defines)
+	{
+		if (key & define.bit)
+			text += std::string("#define ") + define.define + '\n';
+	}
+	text += fragment ? fragment_template : vertex_template;
+	return text;
+}
+
+const stage_program& ProgramCache::get(stage_key key)
+{
+	auto found = programs.find(key);
+	if (found != programs.end())
+		return found->second;
+
+	// a failed compile is cached too, so it's only reported once
+	stage_program& entry = programs[key];
+	std::string vertex = source(key, false);
+	std::string fragment = source(key, true);
+	entry.program = compileProgram(vertex.c_str(), fragment.c_str());
+	if (entry.program == 0)
+	{
+		std::cout << "ProgramCache: stage key 0x" << std::hex << key << std::dec << " didn't compile\n";
+		return entry;
+	}
+
+	glUseProgram(entry.program);
+	glUniform1i(glGetUniformLocation(entry.program, "tex"), 0);
+	entry.view = glGetUniformLocation(entry.program, "view");
+	entry.proj = glGetUniformLocation(entry.program, "proj");
+	entry.model = glGetUniformLocation(entry.program, "model");
+	entry.view_origin = glGetUniformLocation(entry.program, "viewOrigin");
+	entry.colour = glGetUniformLocation(entry.program, "stageColour");
+	entry.tex_matrix = glGetUniformLocation(entry.program, "texMatrix");
+	entry.turb = glGetUniformLocation(entry.program, "turb");
+	return entry;
+}
+
+void ProgramCache::clear()
+{
+	for (auto& entry : programs)
+	{
+		if (entry.second.program != 0)
+			glDeleteProgram(entry.second.program);
+	}
+	programs.clear();
+}
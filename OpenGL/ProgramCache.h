@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "ShaderParser.h"
+
+// where the map's vertex attributes are bound in every program, so one vertex array works
+// with all of them
+const GLuint PositionAttrib = 0;
+const GLuint ColourAttrib = 1;
+const GLuint TexcoordAttrib = 2;
+const GLuint LmcoordAttrib = 3;
+const GLuint NormalAttrib = 4;
+
+// compiles and links a vertex and fragment shader pair with the attribute locations above,
+// returns 0 if it fails to link
+GLuint compileProgram(const char* vertexSource, const char* fragmentSource);
+
+// the parts of a stage that change its glsl, packed into a key. waves, constants, tcMod
+// matrices, blending and textures are all uniforms or gl state, so stages that only differ
+// in those share a program.
+typedef uint32_t stage_key;
+
+enum StageKeyBits : stage_key
+{
+	TcGenLightmap = 1 << 0,
+	TcGenEnvironment = 1 << 1,
+	TcModTurb = 1 << 2,
+	RgbVertex = 1 << 3,
+	RgbOneMinusVertex = 1 << 4,
+	AlphaVertex = 1 << 5,
+	AlphaOneMinusVertex = 1 << 6,
+	AlphaTestGT0 = 1 << 7,
+	AlphaTestLT128 = 1 << 8,
+	AlphaTestGE128 = 1 << 9,
+};
+
+stage_key make_stage_key(const Stage& stage);
+
+// what a stage's uniforms hold at a moment in time
+struct stage_uniforms
+{
+	glm::vec4 colour;
+	glm::mat3 tex_matrix;	// every tcMod but turb, folded into one
+	glm::vec2 turb;			// position in the wave and amplitude
+};
+
+void evaluate_stage(const Stage& stage, float time, stage_uniforms& uniforms);
+
+struct stage_program
+{
+	GLuint program{ 0 };	// 0 if it didn't compile, the stage isn't drawn
+	GLint view{ -1 };
+	GLint proj{ -1 };
+	GLint model{ -1 };
+	GLint view_origin{ -1 };
+	GLint colour{ -1 };
+	GLint tex_matrix{ -1 };
+	GLint turb{ -1 };
+};
+
+// one program per stage key, generated from a shared source with a #define per key bit and
+// compiled the first time the key is asked for. a map's shaders come down to a handful.
+class ProgramCache
+{
+public:
+	// the shared sources, without a #version line
+	ProgramCache(const char* vertex_template, const char* fragment_template)
+		: vertex_template(vertex_template), fragment_template(fragment_template) {}
+
+	const stage_program& get(stage_key key);
+	void clear();
+
+	int size() const { return (int)programs.size(); }
+
+	// one shader of a permutation, with its #defines in front
+	std::string source(stage_key key, bool fragment) const;
+
+private:
+	const char* vertex_template;
+	const char* fragment_template;
+	std::unordered_map<stage_key, stage_program> programs;
+};
@@ -1,5 +1,446 @@
 #include "ShaderParser.h"
 
-void ShaderParser::parse(std::string shader)
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+
+#include "physfs/physfs.h"
+#include "ThreadPool.h"
+
+namespace
+{
+	std::string lower_case(std::string_view text)
+	{
+		std::string lower(text);
+		for (char& c : lower)
+			c = (char)tolower((unsigned char)c);
+		return lower;
+	}
+
+	bool equals_nocase(std::string_view a, std::string_view b)
+	{
+		if (a.size() != b.size()) return false;
+		for (size_t i = 0; i < a.size(); ++i)
+		{
+			if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+		}
+		return true;
+	}
+
+	// the tokens q3's COM_ParseExt sees: anything between whitespace, quoted strings, and
+	// // and /* */ comments skipped
+	struct tokenizer
+	{
+		std::string_view text;
+		size_t pos{ 0 };
+
+		// the next token. with line_breaks false it doesn't go past the end of the line, for
+		// reading a keyword's arguments.
+		bool next(std::string_view& token, bool line_breaks = true)
+		{
+			if (!skip_space(line_breaks))
+				return false;
+
+			if (text[pos] == '"')
+			{
+				size_t close = text.find('"', pos + 1);
+				if (close == std::string_view::npos)
+					close = text.size();
+				token = text.substr(pos + 1, close - pos - 1);
+				pos = std::min(close + 1, text.size());
+				return true;
+			}
+
+			size_t start = pos;
+			while (pos < text.size() && (unsigned char)text[pos] > ' ')
+				pos++;
+			token = text.substr(start, pos - start);
+			return true;
+		}
+
+		// past the end of this line, for arguments nothing reads
+		void skip_line()
+		{
+			size_t line = text.find('\n', pos);
+			pos = line == std::string_view::npos ? text.size() : line + 1;
+		}
+
+		// false at the end of the text, or the end of the line without line_breaks
+		bool skip_space(bool line_breaks)
+		{
+			while (pos < text.size())
+			{
+				if (text[pos] == '\n' && !line_breaks)
+					return false;
+
+				if ((unsigned char)text[pos] <= ' ')
+					pos++;
+				else if (text.compare(pos, 2, "//") == 0)
+				{
+					size_t line = text.find('\n', pos);
+					pos = line == std::string_view::npos ? text.size() : line;
+				}
+				else if (text.compare(pos, 2, "/*") == 0)
+				{
+					size_t close = text.find("*/", pos + 2);
+					pos = close == std::string_view::npos ? text.size() : close + 2;
+				}
+				else
+					return true;
+			}
+			return false;
+		}
+	};
+
+	struct blend_name
+	{
+		const char* name;
+		GLuint factor;
+	};
+
+	const blend_name blend_factors[] = {
+		{ "GL_ONE", GL_ONE },
+		{ "GL_ZERO", GL_ZERO },
+		{ "GL_SRC_COLOR", GL_SRC_COLOR },
+		{ "GL_ONE_MINUS_SRC_COLOR", GL_ONE_MINUS_SRC_COLOR },
+		{ "GL_DST_COLOR", GL_DST_COLOR },
+		{ "GL_ONE_MINUS_DST_COLOR", GL_ONE_MINUS_DST_COLOR },
+		{ "GL_SRC_ALPHA", GL_SRC_ALPHA },
+		{ "GL_ONE_MINUS_SRC_ALPHA", GL_ONE_MINUS_SRC_ALPHA },
+		{ "GL_DST_ALPHA", GL_DST_ALPHA },
+		{ "GL_ONE_MINUS_DST_ALPHA", GL_ONE_MINUS_DST_ALPHA },
+		{ "GL_SRC_ALPHA_SATURATE", GL_SRC_ALPHA_SATURATE },
+	};
+
+	// q3 warns and uses GL_ONE for names it doesn't know
+	GLuint blend_factor(std::string_view name)
+	{
+		for (const blend_name& blend : blend_factors)
+		{
+			if (equals_nocase(name, blend.name)) return blend.factor;
+		}
+		return GL_ONE;
+	}
+
+	void parse_blend(tokenizer& tokens, Stage& stage)
+	{
+		std::string_view src, dst;
+		if (!tokens.next(src, false)) return;
+
+		stage.hasBlend = true;
+		if (equals_nocase(src, "add"))
+		{
+			stage.BlendSrc = GL_ONE;
+			stage.BlendDst = GL_ONE;
+		}
+		else if (equals_nocase(src, "filter"))
+		{
+			stage.BlendSrc = GL_DST_COLOR;
+			stage.BlendDst = GL_ZERO;
+		}
+		else if (equals_nocase(src, "blend"))
+		{
+			stage.BlendSrc = GL_SRC_ALPHA;
+			stage.BlendDst = GL_ONE_MINUS_SRC_ALPHA;
+		}
+		else
+		{
+			stage.BlendSrc = blend_factor(src);
+			stage.BlendDst = tokens.next(dst, false) ? blend_factor(dst) : GL_ONE;
+		}
+	}
+
+	// 0 for an argument that isn't there, like q3's atof of an empty token
+	float next_float(tokenizer& tokens)
+	{
+		std::string_view token;
+		if (!tokens.next(token, false))
+			return 0.f;
+		return strtof(std::string(token).c_str(), nullptr);
+	}
+
+	// func base amplitude phase frequency
+	void parse_wave(tokenizer& tokens, Wave& wave)
+	{
+		std::string_view func;
+		if (!tokens.next(func, false)) return;
+
+		if (equals_nocase(func, "triangle")) wave.func = WaveFunc::Triangle;
+		else if (equals_nocase(func, "square")) wave.func = WaveFunc::Square;
+		else if (equals_nocase(func, "sawtooth")) wave.func = WaveFunc::Sawtooth;
+		else if (equals_nocase(func, "inversesawtooth")) wave.func = WaveFunc::InverseSawtooth;
+		else if (equals_nocase(func, "noise")) wave.func = WaveFunc::Noise;
+		else wave.func = WaveFunc::Sin;
+
+		wave.base = next_float(tokens);
+		wave.amplitude = next_float(tokens);
+		wave.phase = next_float(tokens);
+		wave.frequency = next_float(tokens);
+	}
+
+	void parse_tcmod(tokenizer& tokens, Stage& stage)
+	{
+		std::string_view type;
+		if (!tokens.next(type, false)) return;
+
+		TcMod mod;
+		int params = 0;
+		if (equals_nocase(type, "scroll")) { mod.type = TcModType::Scroll; params = 2; }
+		else if (equals_nocase(type, "scale")) { mod.type = TcModType::Scale; params = 2; }
+		else if (equals_nocase(type, "rotate")) { mod.type = TcModType::Rotate; params = 1; }
+		else if (equals_nocase(type, "transform")) { mod.type = TcModType::Transform; params = 6; }
+		else if (equals_nocase(type, "stretch"))
+		{
+			mod.type = TcModType::Stretch;
+			parse_wave(tokens, mod.wave);
+		}
+		else if (equals_nocase(type, "turb"))
+		{
+			// base amplitude phase frequency, always a sine
+			mod.type = TcModType::Turb;
+			mod.wave.base = next_float(tokens);
+			mod.wave.amplitude = next_float(tokens);
+			mod.wave.phase = next_float(tokens);
+			mod.wave.frequency = next_float(tokens);
+		}
+		else
+			return;
+
+		for (int i = 0; i < params; ++i)
+			mod.params[i] = next_float(tokens);
+		stage.tcMods.push_back(mod);
+	}
+
+	// rgbGen and alphaGen: the kind, and the wave or constant some kinds take
+	void parse_gen(tokenizer& tokens, std::string& kind, Wave& wave, float* constant, int components)
+	{
+		std::string_view token;
+		if (!tokens.next(token, false)) return;
+		kind = lower_case(token);
+
+		if (equals_nocase(token, "wave"))
+			parse_wave(tokens, wave);
+		else if (equals_nocase(token, "const"))
+		{
+			// rgbGen const ( r g b ), alphaGen const a
+			for (int i = 0; i < components; ++i)
+			{
+				if (!tokens.next(token, false)) return;
+				if (token == "(")
+				{
+					--i;
+					continue;
+				}
+				constant[i] = strtof(std::string(token).c_str(), nullptr);
+			}
+		}
+	}
+
+	// one { } stage, up to and including its closing brace
+	void parse_stage(tokenizer& tokens, Stage& stage)
+	{
+		std::string_view token;
+		while (tokens.next(token))
+		{
+			if (token == "}")
+				return;
+
+			if (equals_nocase(token, "map"))
+			{
+				if (tokens.next(token, false)) stage.map = token;
+			}
+			else if (equals_nocase(token, "clampmap"))
+			{
+				if (tokens.next(token, false)) stage.map = token;
+				stage.clamp = "clamp";
+			}
+			else if (equals_nocase(token, "animmap"))
+			{
+				// the frequency, then up to 8 frames
+				stage.animFrequency = next_float(tokens);
+				while (stage.animFrames.size() < 8 && tokens.next(token, false))
+					stage.animFrames.push_back(std::string(token));
+				if (!stage.animFrames.empty()) stage.map = stage.animFrames[0];
+			}
+			else if (equals_nocase(token, "blendfunc"))
+				parse_blend(tokens, stage);
+			else if (equals_nocase(token, "rgbgen"))
+				parse_gen(tokens, stage.rgb, stage.rgbWave, stage.rgbConst, 3);
+			else if (equals_nocase(token, "alphagen"))
+				parse_gen(tokens, stage.alpha, stage.alphaWave, &stage.alphaConst, 1);
+			else if (equals_nocase(token, "tcgen") || equals_nocase(token, "texgen"))
+			{
+				if (tokens.next(token, false)) stage.tcGen = lower_case(token);
+			}
+			else if (equals_nocase(token, "tcmod"))
+				parse_tcmod(tokens, stage);
+			else if (equals_nocase(token, "alphafunc"))
+			{
+				if (tokens.next(token, false)) stage.alphaFunc = lower_case(token);
+			}
+			else if (equals_nocase(token, "depthwrite"))
+				stage.depthWrite = true;
+			else
+			{
+				// the keywords above only read their own arguments, so a } after them on the
+				// same line still closes the stage
+				tokens.skip_line();
+			}
+		}
+	}
+}
+
+void ShaderParser::clear()
 {
+	files.clear();
+	index.clear();
+	parsed.clear();
+}
+
+void ShaderParser::load(const std::string& directory)
+{
+	clear();
+
+	std::vector<std::string> names;
+	char** listed = PHYSFS_enumerateFiles(directory.c_str());
+	if (listed != NULL)
+	{
+		for (char** i = listed; *i != NULL; i++)
+		{
+			std::string name{ *i };
+			if (name.length() > 7 && equals_nocase(std::string_view(name).substr(name.length() - 7), ".shader"))
+				names.push_back(name);
+		}
+		PHYSFS_freeList(listed);
+	}
+
+	// the order decides which definition wins, q3 sorts the list ignoring case
+	std::sort(names.begin(), names.end(), [](const std::string& a, const std::string& b) { return lower_case(a) < lower_case(b); });
+
+	// physfs reads one file at a time, the scanning is what gets split across threads
+	files.resize(names.size());
+	for (int i = 0; i < names.size(); ++i)
+	{
+		PHYSFS_File* handle = PHYSFS_openRead((directory + "/" + names[i]).c_str());
+		if (handle == NULL) continue;
+
+		files[i].resize((size_t)PHYSFS_fileLength(handle));
+		if (!files[i].empty())
+			PHYSFS_readBytes(handle, &files[i][0], files[i].size());
+		PHYSFS_close(handle);
+	}
+
+	std::vector<std::vector<definition>> found(files.size());
+	std::vector<char> broken(files.size(), 0);
+	ThreadPool::shared().parallel_for((int)files.size(), 1, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+		{
+			// like q3, a file with a mistake in its braces is left out altogether
+			if (!scan(files[i], i, found[i]))
+			{
+				found[i].clear();
+				broken[i] = 1;
+			}
+		}
+	});
+
+	// from the last file back, the first definition of a name to reach the index is the one
+	// q3 would use
+	for (int i = (int)files.size() - 1; i >= 0; --i)
+	{
+		if (broken[i])
+			std::cout << "ShaderParser error: ignoring " << names[i] << ", its braces don't match\n";
+
+		for (definition& def : found[i])
+		{
+			std::string key = lower_case(def.name);
+			index.emplace(std::move(key), std::move(def));
+		}
+	}
+}
+
+bool ShaderParser::scan(const std::string& text, int file, std::vector<definition>& found)
+{
+	tokenizer tokens{ text };
+	std::string_view name, token;
+
+	while (tokens.next(name))
+	{
+		if (!tokens.next(token) || token != "{")
+			return false;
+
+		definition def;
+		def.name = name;
+		def.file = file;
+		def.begin = tokens.pos;
+
+		// braces only count as tokens of their own, the way q3 skips a section
+		int depth = 1;
+		while (depth > 0)
+		{
+			if (!tokens.next(token))
+				return false;
+
+			if (token == "{")
+				depth++;
+			else if (token == "}")
+				depth--;
+		}
+
+		def.end = tokens.pos - 1;
+		found.push_back(std::move(def));
+	}
+
+	return true;
+}
+
+void ShaderParser::parse(std::string_view body, Shader& shader)
+{
+	tokenizer tokens{ body };
+	std::string_view token;
+
+	while (tokens.next(token))
+	{
+		if (token == "{")
+		{
+			Stage stage;
+			parse_stage(tokens, stage);
+			shader.stages.push_back(stage);
+			continue;
+		}
+
+		if (equals_nocase(token, "surfaceparm"))
+		{
+			if (!tokens.next(token, false)) continue;
+			if (equals_nocase(token, "sky")) shader.sky = true;
+			else if (equals_nocase(token, "nodraw")) shader.nodraw = true;
+			else if (equals_nocase(token, "trans")) shader.trans = true;
+		}
+		else if (equals_nocase(token, "cull"))
+		{
+			if (!tokens.next(token, false)) continue;
+			if (equals_nocase(token, "none") || equals_nocase(token, "twosided") || equals_nocase(token, "disable"))
+				shader.twoSided = true;
+		}
+		else
+			tokens.skip_line();
+	}
+}
+
+const Shader* ShaderParser::find(std::string_view name)
+{
+	auto found = index.find(lower_case(name));
+	if (found == index.end())
+		return nullptr;
+
+	definition& def = found->second;
+	if (def.parsed == nullptr)
+	{
+		parsed.emplace_back();
+		def.parsed = &parsed.back();
+		def.parsed->name = def.name;
+		parse(std::string_view(files[def.file]).substr(def.begin, def.end - def.begin), *def.parsed);
+	}
+	return def.parsed;
 }
@@ -1,31 +1,106 @@
 #pragma once
 
+#include <deque>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <GLFW/glfw3.h>
 
+// q3's waveforms for rgbGen, alphaGen and tcMod: base + amplitude * func(phase + time * frequency)
+enum class WaveFunc { Sin, Triangle, Square, Sawtooth, InverseSawtooth, Noise };
+
+struct Wave
+{
+	WaveFunc func{ WaveFunc::Sin };
+	float base{ 0.f };
+	float amplitude{ 0.f };
+	float phase{ 0.f };
+	float frequency{ 0.f };
+};
+
+enum class TcModType { Scroll, Scale, Rotate, Stretch, Transform, Turb };
+
+struct TcMod
+{
+	TcModType type;
+	// scroll and scale s t, rotate degrees a second, transform m00 m01 m10 m11 t0 t1
+	float params[6]{};
+	Wave wave;	// stretch and turb
+};
+
 struct Stage
 {
 	std::string map;
 	bool hasBlend{ false };
 	GLuint BlendSrc{ GL_ONE };
 	GLuint BlendDst{ GL_ONE };
+	// rgb, alpha, tcGen and alphaFunc are lower case whatever the script wrote
 	std::string rgb;
 	std::string clamp;
 	std::string alpha;
 	std::string tcGen;
+
+	// animMap frames, map is the first of them
+	std::vector<std::string> animFrames;
+	float animFrequency{ 0.f };
+	std::vector<TcMod> tcMods;
+	Wave rgbWave;
+	Wave alphaWave;
+	float rgbConst[3]{ 1.f, 1.f, 1.f };
+	float alphaConst{ 1.f };
+	std::string alphaFunc;
+	bool depthWrite{ false };
 };
 
 struct Shader
 {
 	std::string name;
 	std::vector<Stage> stages;
+
+	// the surfaceparms the renderer cares about
+	bool sky{ false };
+	bool nodraw{ false };
+	bool trans{ false };
+	bool twoSided{ false };	// cull none
 };
 
+// the shader scripts under scripts/, indexed by name when they're loaded. a definition's
+// body is only parsed into stages the first time something asks for it, most of baseq3's
+// shaders are never used by any one map.
 class ShaderParser
 {
 public:
-	void parse(std::string shader);
-};
+	// reads every .shader in the directory and indexes their definitions. the files are
+	// scanned in parallel. like q3, a shader defined more than once comes from the file that
+	// sorts last, and the first definition in that file.
+	void load(const std::string& directory = "/data/scripts");
+	void clear();
+
+	// the definition of a shader, nullptr if no script has one. names aren't case sensitive.
+	const Shader* find(std::string_view name);
 
+	int file_count() const { return (int)files.size(); }
+	int definition_count() const { return (int)index.size(); }
+
+private:
+	// where a definition's body sits, between its braces
+	struct definition
+	{
+		std::string name;
+		int file;
+		size_t begin;
+		size_t end;
+		Shader* parsed{ nullptr };
+	};
+
+	// the top level of one file: names and body ranges, nothing inside the braces. false if
+	// the braces don't match.
+	static bool scan(const std::string& text, int file, std::vector<definition>& found);
+	static void parse(std::string_view body, Shader& shader);
+
+	std::vector<std::string> files;
+	std::unordered_map<std::string, definition> index;	// lower case names
+	std::deque<Shader> parsed;	// stays put as it grows, find hands out pointers into it
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+// sse2 is the baseline on every x64 target (and on x86 with /arch:SSE2), anything else
+// falls back to the scalar paths.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define USE_SSE2 0
+#endif
@@ -0,0 +1,196 @@
+#include "TagHierarchy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+// how far a transform can be from q3's, in units for the origin and per axis component
+const float MaxTagError = 1e-3f;
+
+int TagHierarchy::add_part(const Model* model, int parent, const std::string& tag)
+{
+	if (model == nullptr || parent >= (int)parts.size()) return -1;
+
+	int index = -1;
+	if (parent >= 0)
+	{
+		const Model* holder = parts[parent].model;
+		index = holder->FrameCount() > 0 ? holder->FindTag(tag) : -1;
+		if (index < 0) return -1;
+	}
+
+	parts.push_back(part{ model, parent, index });
+	return (int)parts.size() - 1;
+}
+
+void TagHierarchy::evaluate(const glm::mat4* roots, const tag_frame* frames, int instances, glm::mat4* out) const
+{
+	const int count = (int)parts.size();
+
+	// one instance at a time with its parts in order, so a parent's transform is still in
+	// cache when its children use it. the tags themselves are a few kb per model.
+	for (int i = 0; i < instances; ++i)
+	{
+		const tag_frame* instance_frames = frames + i * count;
+		glm::mat4* instance_out = out + i * count;
+
+		for (int p = 0; p < count; ++p)
+		{
+			const part& _part = parts[p];
+			if (_part.parent < 0)
+			{
+				instance_out[p] = roots[i];
+				continue;
+			}
+
+			// the tag moves with the parent's animation
+			const Model& holder = *parts[_part.parent].model;
+			const tag_frame& frame = instance_frames[_part.parent];
+			int last = holder.FrameCount() - 1;
+			const MD3Tag& a = holder.GetTag(std::min(std::max(frame.from, 0), last), _part.tag);
+			const MD3Tag& b = holder.GetTag(std::min(std::max(frame.to, 0), last), _part.tag);
+
+			// blended like q3's R_LerpTag, each axis renormalised on its own
+			float front = frame.fraction;
+			float back = 1.f - front;
+			glm::vec3 origin = a.origin * back + b.origin * front;
+			glm::vec3 axis[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				axis[k] = a.axis[k] * back + b.axis[k] * front;
+				axis[k] = axis[k] * (1.f / std::max(glm::length(axis[k]), 1e-6f));
+			}
+
+			const glm::mat4& parent = instance_out[_part.parent];
+			glm::mat4 local(glm::vec4(axis[0], 0.f), glm::vec4(axis[1], 0.f), glm::vec4(axis[2], 0.f), glm::vec4(origin, 1.f));
+			instance_out[p] = parent * local;
+		}
+	}
+}
+
+// q3's orientation_t: an origin and forward, left and up as rows
+struct q3_orientation
+{
+	float origin[3];
+	float axis[3][3];
+};
+
+static void q3_lerp_tag(q3_orientation& tag, const MD3Tag& start, const MD3Tag& end, float frac)
+{
+	float frontLerp = frac;
+	float backLerp = 1.0f - frac;
+
+	for (int i = 0; i < 3; i++)
+	{
+		tag.origin[i] = start.origin[i] * backLerp + end.origin[i] * frontLerp;
+		tag.axis[0][i] = start.axis[0][i] * backLerp + end.axis[0][i] * frontLerp;
+		tag.axis[1][i] = start.axis[1][i] * backLerp + end.axis[1][i] * frontLerp;
+		tag.axis[2][i] = start.axis[2][i] * backLerp + end.axis[2][i] * frontLerp;
+	}
+
+	for (int k = 0; k < 3; k++)
+	{
+		float length = sqrtf(tag.axis[k][0] * tag.axis[k][0] + tag.axis[k][1] * tag.axis[k][1] + tag.axis[k][2] * tag.axis[k][2]);
+		if (length > 0.f)
+		{
+			for (int i = 0; i < 3; i++)
+				tag.axis[k][i] /= length;
+		}
+	}
+}
+
+static void q3_position_on_tag(q3_orientation& entity, const q3_orientation& parent, const q3_orientation& lerped)
+{
+	for (int i = 0; i < 3; i++)
+		entity.origin[i] = parent.origin[i];
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			entity.origin[j] += lerped.origin[i] * parent.axis[i][j];
+	}
+
+	// MatrixMultiply( lerped.axis, parent->axis, entity->axis )
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			entity.axis[i][j] = lerped.axis[i][0] * parent.axis[0][j] + lerped.axis[i][1] * parent.axis[1][j] + lerped.axis[i][2] * parent.axis[2][j];
+	}
+}
+
+tag_benchmark TagHierarchy::benchmark(int instances, int repeats) const
+{
+	tag_benchmark result;
+	const int count = (int)parts.size();
+	if (count == 0 || instances <= 0) return result;
+
+	// instances spread around and turned, every part at its own point in its animation
+	std::vector<glm::mat4> roots(instances);
+	std::vector<tag_frame> frames(instances * count);
+	for (int i = 0; i < instances; ++i)
+	{
+		roots[i] = glm::rotate(glm::translate(glm::mat4(1.f), glm::vec3((float)(i % 32) * 64.f, (float)(i / 32) * 64.f, 0.f)),
+			glm::radians((float)(i * 37 % 360)), glm::vec3(0.f, 0.f, 1.f));
+
+		for (int p = 0; p < count; ++p)
+		{
+			int frame_count = std::max(parts[p].model->FrameCount(), 1);
+			tag_frame& frame = frames[i * count + p];
+			frame.from = (i * 7 + p * 3) % frame_count;
+			frame.to = (frame.from + 1) % frame_count;
+			frame.fraction = (float)((i + p) % 10) / 10.f;
+		}
+	}
+
+	std::vector<glm::mat4> out(instances * count);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < repeats; ++r)
+		evaluate(roots.data(), frames.data(), instances, out.data());
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+	result.transforms = instances * count;
+	result.rate = elapsed.count() > 0 ? (double)result.transforms * repeats / elapsed.count() : 0;
+
+	// the same through q3's own arithmetic, where a tag's axes are rows and a child's axes
+	// are its tag's axes in the parent's frame
+	std::vector<q3_orientation> expected(count);
+	for (int i = 0; i < instances; ++i)
+	{
+		for (int p = 0; p < count; ++p)
+		{
+			const part& _part = parts[p];
+			q3_orientation& entity = expected[p];
+			if (_part.parent < 0)
+			{
+				for (int k = 0; k < 3; ++k)
+				{
+					entity.origin[k] = roots[i][3][k];
+					for (int j = 0; j < 3; ++j)
+						entity.axis[k][j] = roots[i][k][j];
+				}
+			}
+			else
+			{
+				const Model& holder = *parts[_part.parent].model;
+				const tag_frame& frame = frames[i * count + _part.parent];
+				int last = holder.FrameCount() - 1;
+				q3_orientation lerped;
+				q3_lerp_tag(lerped, holder.GetTag(std::min(std::max(frame.from, 0), last), _part.tag),
+					holder.GetTag(std::min(std::max(frame.to, 0), last), _part.tag), frame.fraction);
+				q3_position_on_tag(entity, expected[_part.parent], lerped);
+			}
+
+			const glm::mat4& m = out[i * count + p];
+			for (int k = 0; k < 3; ++k)
+			{
+				result.max_error = std::max(result.max_error, fabsf(m[3][k] - entity.origin[k]));
+				for (int j = 0; j < 3; ++j)
+					result.max_error = std::max(result.max_error, fabsf(m[k][j] - entity.axis[k][j]));
+			}
+		}
+	}
+
+	result.passed = result.max_error <= MaxTagError;
+	return result;
+}
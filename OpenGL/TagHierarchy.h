@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "MD3Loader.h"
+
+// where a part's model is in its animation, 0 is all from and 1 is all to
+struct tag_frame
+{
+	int from{ 0 };
+	int to{ 0 };
+	float fraction{ 0.f };
+};
+
+// evaluate against a straight port of q3's R_LerpTag and CG_PositionEntityOnTag, the rate
+// is part transforms per second
+struct tag_benchmark
+{
+	int transforms{ 0 };
+	double rate{ 0 };
+	float max_error{ 0 };
+	bool passed{ false };	// every transform within tolerance of q3's
+};
+
+// the models that make up one kind of entity and the tags they hang from, like a player's
+// legs at the root, torso on the legs' tag_torso, and head and weapon on the torso's
+// tag_head and tag_weapon. one hierarchy is shared by every entity built that way.
+class TagHierarchy
+{
+public:
+	void clear() { parts.clear(); }
+
+	// adds a part hung from tag on its parent part's model, or the root with no parent.
+	// parents have to be added first. returns the part's index, or -1 if there's no such tag.
+	int add_part(const Model* model, int parent = -1, const std::string& tag = "");
+	int part_count() const { return (int)parts.size(); }
+
+	// the transform of every part of every instance. roots has one transform per instance and
+	// frames part_count() per instance, the animation each part's model is playing. out gets
+	// part_count() transforms per instance laid out the same way. nothing is allocated, so
+	// the caller's arrays can be reused frame after frame.
+	void evaluate(const glm::mat4* roots, const tag_frame* frames, int instances, glm::mat4* out) const;
+
+	// evaluates instances copies of the hierarchy, each part partway through a different
+	// pair of frames, repeats times
+	tag_benchmark benchmark(int instances, int repeats) const;
+
+private:
+	struct part
+	{
+		const Model* model;
+		int parent;
+		int tag;		// in the parent's model
+	};
+
+	std::vector<part> parts;
+};
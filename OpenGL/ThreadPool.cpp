@@ -0,0 +1,94 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int workers)
+{
+	for (unsigned int i = 0; i < workers; ++i)
+		threads.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto& thread : threads)
+		thread.join();
+}
+
+ThreadPool& ThreadPool::shared()
+{
+	static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+	return pool;
+}
+
+void ThreadPool::parallel_for(int count, int grain, const std::function<void(int, int)>& fn)
+{
+	if (count <= 0) return;
+	grain = std::max(grain, 1);
+
+	// not worth waking anyone for a single chunk
+	if (threads.empty() || count <= grain)
+	{
+		fn(0, count);
+		return;
+	}
+
+	std::lock_guard<std::mutex> serial(submit);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &fn;
+		job_count = count;
+		job_grain = grain;
+		next = 0;
+		generation++;
+	}
+	wake.notify_all();
+
+	run_chunks();
+
+	// every chunk has been claimed, wait for the workers still running one
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return active == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::run_chunks()
+{
+	for (;;)
+	{
+		int begin = next.fetch_add(job_grain);
+		if (begin >= job_count) break;
+
+		(*job)(begin, std::min(begin + job_grain, job_count));
+	}
+}
+
+void ThreadPool::worker()
+{
+	unsigned int seen = 0;
+
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		wake.wait(lock, [&] { return stopping || generation != seen; });
+		if (stopping) return;
+
+		seen = generation;
+		if (job == nullptr) continue;
+
+		active++;
+		lock.unlock();
+
+		run_chunks();
+
+		lock.lock();
+		if (--active == 0)
+			done.notify_all();
+	}
+}
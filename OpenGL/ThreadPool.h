@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of worker threads for splitting loops over independent items.
+// the calling thread works on the loop too, and parallel_for returns once every item is done.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned int workers);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// calls fn(begin, end) on chunks of at most grain items covering [0, count).
+	// not re-entrant: fn must not call parallel_for on the same pool.
+	void parallel_for(int count, int grain, const std::function<void(int, int)>& fn);
+
+	// worker threads plus the calling thread
+	unsigned int concurrency() const { return (unsigned int)threads.size() + 1; }
+
+	// pool shared by the loaders, one worker per extra hardware thread
+	static ThreadPool& shared();
+
+private:
+	void worker();
+	void run_chunks();
+
+	std::vector<std::thread> threads;
+
+	std::mutex submit;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	const std::function<void(int, int)>* job{ nullptr };
+	int job_count{ 0 };
+	int job_grain{ 1 };
+	std::atomic<int> next{ 0 };
+	int active{ 0 };
+	unsigned int generation{ 0 };
+	bool stopping{ false };
+};
@@ -0,0 +1,572 @@
+#include "TriangleBVH.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <random>
+
+#include "Simd.h"
+
+const int MaxLeafTriangles = 4;
+// a leaf this small is kept when splitting it wouldn't pay for the extra node
+const int MaxCheapLeafTriangles = 16;
+const int SahBins = 16;
+// deeper than this every node becomes a leaf, so the traversal stacks can't overflow
+const int MaxDepth = 60;
+const int StackSize = 64;
+
+// determinants this close to 0 are rays running along the triangle's plane
+const float ParallelEpsilon = 1e-8f;
+
+static float surface_area(const glm::vec3& mins, const glm::vec3& maxs)
+{
+	glm::vec3 d = maxs - mins;
+	return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void TriangleBVH::clear()
+{
+	nodes.clear();
+	triangles.clear();
+}
+
+void TriangleBVH::build(const BSPLoader& loader)
+{
+	clear();
+
+	const std::vector<vertex>& vertices = loader.get_vertex_data();
+	const std::vector<unsigned int>& indices = loader.get_indices();
+
+	std::vector<bvh_triangle> raw;
+	for (int i = 0; i < loader.get_face_count(); ++i)
+	{
+		face _face = loader.get_face(i);
+
+		if (_face.type == FaceTypes::Billboard || _face.n_meshverts < 3) continue;
+		if (!loader.get_shader(_face.texture).render) continue;
+
+		for (int j = 0; j + 2 < _face.n_meshverts; j += 3)
+		{
+			int first = _face.meshvert + j;
+			const glm::vec3& p0 = vertices[indices[first]].position;
+
+			bvh_triangle tri;
+			tri.v0 = p0;
+			tri.e1 = vertices[indices[first + 1]].position - p0;
+			tri.e2 = vertices[indices[first + 2]].position - p0;
+			tri.id = first / 3;
+			tri.face = i;
+			tri.shader = _face.texture;
+			raw.push_back(tri);
+		}
+	}
+
+	// models are stored once in their own space, so their triangles are moved into each placement here
+	const std::vector<model_vertex>& model_vertices = loader.get_model_vertices();
+	const std::vector<unsigned int>& model_indices = loader.get_model_indices();
+	const std::vector<model_surface>& model_surfaces = loader.get_model_surfaces();
+	const std::vector<model_instance>& instances = loader.get_model_instances();
+	for (int i = 0; i < instances.size(); ++i)
+	{
+		// picking goes by the full detail model whatever level is being drawn
+		const model_lod& lod = loader.get_model_meshes()[instances[i].mesh].lods[0];
+		for (int s = lod.first_surface; s < lod.first_surface + lod.n_surfaces; ++s)
+		{
+			const model_surface& surface = model_surfaces[s];
+			if (!loader.get_shader(surface.texture).render) continue;
+
+			for (int j = 0; j + 2 < surface.n_indices; j += 3)
+			{
+				int first = surface.first_index + j;
+				glm::vec3 p[3];
+				for (int k = 0; k < 3; ++k)
+					p[k] = glm::vec3(instances[i].transform * glm::vec4(model_vertices[model_indices[first + k]].position, 1.f));
+
+				bvh_triangle tri;
+				tri.v0 = p[0];
+				tri.e1 = p[1] - p[0];
+				tri.e2 = p[2] - p[0];
+				tri.id = first / 3;
+				tri.face = -1 - i;
+				tri.shader = surface.texture;
+				raw.push_back(tri);
+			}
+		}
+	}
+
+	if (raw.empty()) return;
+
+	std::vector<build_triangle> bounds(raw.size());
+	std::vector<int> order(raw.size());
+	for (int i = 0; i < raw.size(); ++i)
+	{
+		glm::vec3 p1 = raw[i].v0 + raw[i].e1;
+		glm::vec3 p2 = raw[i].v0 + raw[i].e2;
+		bounds[i].mins = glm::min(raw[i].v0, glm::min(p1, p2));
+		bounds[i].maxs = glm::max(raw[i].v0, glm::max(p1, p2));
+		bounds[i].centre = (bounds[i].mins + bounds[i].maxs) * 0.5f;
+		order[i] = i;
+	}
+
+	nodes.reserve(raw.size() * 2);
+	nodes.push_back(bvh_node{});
+	build_node(0, 0, (int)raw.size(), bounds, order, 0);
+
+	// leafs refer to triangles in build order
+	triangles.resize(raw.size());
+	for (int i = 0; i < raw.size(); ++i)
+		triangles[i] = raw[order[i]];
+}
+
+void TriangleBVH::build_node(int n, int first, int count, std::vector<build_triangle>& bounds, std::vector<int>& order, int depth)
+{
+	glm::vec3 mins(FLT_MAX), maxs(-FLT_MAX);
+	glm::vec3 cmins(FLT_MAX), cmaxs(-FLT_MAX);
+	for (int i = first; i < first + count; ++i)
+	{
+		const build_triangle& b = bounds[order[i]];
+		mins = glm::min(mins, b.mins);
+		maxs = glm::max(maxs, b.maxs);
+		cmins = glm::min(cmins, b.centre);
+		cmaxs = glm::max(cmaxs, b.centre);
+	}
+
+	nodes[n].mins = mins;
+	nodes[n].maxs = maxs;
+	nodes[n].first = first;
+	nodes[n].count = count;
+
+	if (count <= MaxLeafTriangles || depth >= MaxDepth) return;
+
+	// bin the centres along each axis and take the cheapest split between bins, costing
+	// each side as its triangle count times its surface area
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_bin = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float extent = cmaxs[axis] - cmins[axis];
+		if (extent <= 0.f) continue;
+
+		int bin_count[SahBins] = {};
+		glm::vec3 bin_mins[SahBins], bin_maxs[SahBins];
+		for (int b = 0; b < SahBins; ++b)
+		{
+			bin_mins[b] = glm::vec3(FLT_MAX);
+			bin_maxs[b] = glm::vec3(-FLT_MAX);
+		}
+
+		float scale = SahBins / extent;
+		for (int i = first; i < first + count; ++i)
+		{
+			const build_triangle& t = bounds[order[i]];
+			int b = std::min(SahBins - 1, (int)((t.centre[axis] - cmins[axis]) * scale));
+			bin_count[b]++;
+			bin_mins[b] = glm::min(bin_mins[b], t.mins);
+			bin_maxs[b] = glm::max(bin_maxs[b], t.maxs);
+		}
+
+		// area and count of everything right of each split
+		float right_area[SahBins];
+		int right_count[SahBins];
+		glm::vec3 rmins(FLT_MAX), rmaxs(-FLT_MAX);
+		int rcount = 0;
+		for (int b = SahBins - 1; b > 0; --b)
+		{
+			rcount += bin_count[b];
+			rmins = glm::min(rmins, bin_mins[b]);
+			rmaxs = glm::max(rmaxs, bin_maxs[b]);
+			right_count[b] = rcount;
+			right_area[b] = rcount > 0 ? surface_area(rmins, rmaxs) : 0.f;
+		}
+
+		glm::vec3 lmins(FLT_MAX), lmaxs(-FLT_MAX);
+		int lcount = 0;
+		for (int b = 0; b < SahBins - 1; ++b)
+		{
+			lcount += bin_count[b];
+			lmins = glm::min(lmins, bin_mins[b]);
+			lmaxs = glm::max(lmaxs, bin_maxs[b]);
+			if (lcount == 0 || right_count[b + 1] == 0) continue;
+
+			float cost = lcount * surface_area(lmins, lmaxs) + right_count[b + 1] * right_area[b + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	int mid;
+	if (best_axis < 0)
+	{
+		// every centre is in the same place, any split is as good as another
+		mid = count / 2;
+	}
+	else
+	{
+		if (best_cost >= count * surface_area(mins, maxs) && count <= MaxCheapLeafTriangles) return;
+
+		float scale = SahBins / (cmaxs[best_axis] - cmins[best_axis]);
+		auto split = std::partition(order.begin() + first, order.begin() + first + count, [&](int t) {
+			int b = std::min(SahBins - 1, (int)((bounds[t].centre[best_axis] - cmins[best_axis]) * scale));
+			return b <= best_bin;
+		});
+		mid = (int)(split - (order.begin() + first));
+	}
+
+	int left = (int)nodes.size();
+	nodes.push_back(bvh_node{});
+	nodes.push_back(bvh_node{});
+	nodes[n].first = left;
+	nodes[n].count = 0;
+
+	build_node(left, first, mid, bounds, order, depth + 1);
+	build_node(left + 1, first + mid, count - mid, bounds, order, depth + 1);
+}
+
+// slab test, returns the entry distance or FLT_MAX for a miss
+static float box_entry(const glm::vec3& mins, const glm::vec3& maxs, const glm::vec3& origin, const glm::vec3& inverse, float max_t)
+{
+	glm::vec3 t1 = (mins - origin) * inverse;
+	glm::vec3 t2 = (maxs - origin) * inverse;
+	glm::vec3 near_t = glm::min(t1, t2);
+	glm::vec3 far_t = glm::max(t1, t2);
+
+	float enter = std::max(std::max(near_t.x, near_t.y), std::max(near_t.z, 0.f));
+	float leave = std::min(std::min(far_t.x, far_t.y), std::min(far_t.z, max_t));
+
+	return enter <= leave ? enter : FLT_MAX;
+}
+
+void TriangleBVH::finish_hit(ray_hit& hit) const
+{
+	// the walk records triangles in bvh order
+	if (hit.triangle < 0) return;
+
+	const bvh_triangle& tri = triangles[hit.triangle];
+	hit.triangle = tri.id;
+	hit.face = tri.face >= 0 ? tri.face : -1;
+	hit.instance = tri.face >= 0 ? -1 : -1 - tri.face;
+	hit.shader = tri.shader;
+}
+
+ray_hit TriangleBVH::intersect(const glm::vec3& origin, const glm::vec3& direction, float max_t) const
+{
+	ray_hit hit;
+	hit.t = max_t;
+
+	if (nodes.empty()) return hit;
+
+	glm::vec3 inverse = 1.f / direction;
+
+	int stack[StackSize];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const bvh_node& _node = nodes[stack[--top]];
+
+		if (_node.count > 0)
+		{
+			// moller-trumbore, both sides of the triangle count
+			for (int i = _node.first; i < _node.first + _node.count; ++i)
+			{
+				const bvh_triangle& tri = triangles[i];
+
+				glm::vec3 p = glm::cross(direction, tri.e2);
+				float det = glm::dot(tri.e1, p);
+				if (fabsf(det) <= ParallelEpsilon) continue;
+				float inv_det = 1.f / det;
+
+				glm::vec3 s = origin - tri.v0;
+				float u = glm::dot(s, p) * inv_det;
+				if (u < 0.f || u > 1.f) continue;
+
+				glm::vec3 q = glm::cross(s, tri.e1);
+				float v = glm::dot(direction, q) * inv_det;
+				if (v < 0.f || u + v > 1.f) continue;
+
+				float t = glm::dot(tri.e2, q) * inv_det;
+				if (t > 0.f && t < hit.t)
+				{
+					hit.t = t;
+					hit.triangle = i;
+					hit.u = u;
+					hit.v = v;
+				}
+			}
+			continue;
+		}
+
+		// visit the nearer child first so the further one is more likely to be culled
+		float left = box_entry(nodes[_node.first].mins, nodes[_node.first].maxs, origin, inverse, hit.t);
+		float right = box_entry(nodes[_node.first + 1].mins, nodes[_node.first + 1].maxs, origin, inverse, hit.t);
+
+		if (left <= right)
+		{
+			if (right != FLT_MAX) stack[top++] = _node.first + 1;
+			if (left != FLT_MAX) stack[top++] = _node.first;
+		}
+		else
+		{
+			if (left != FLT_MAX) stack[top++] = _node.first;
+			stack[top++] = _node.first + 1;
+		}
+	}
+
+	finish_hit(hit);
+	return hit;
+}
+
+#if USE_SSE2
+// four rays of a packet, one per lane
+struct ray_quad
+{
+	__m128 ox, oy, oz;
+	__m128 dx, dy, dz;
+	__m128 ix, iy, iz;
+	__m128 t, u, v;
+	__m128i id;
+	__m128 active;
+};
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 quad_box(const ray_quad& r, const glm::vec3& mins, const glm::vec3& maxs)
+{
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(mins.x), r.ox), r.ix);
+	__m128 t2x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxs.x), r.ox), r.ix);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(mins.y), r.oy), r.iy);
+	__m128 t2y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxs.y), r.oy), r.iy);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(mins.z), r.oz), r.iz);
+	__m128 t2z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxs.z), r.oz), r.iz);
+
+	__m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_max_ps(_mm_min_ps(t1z, t2z), _mm_setzero_ps()));
+	__m128 leave = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_min_ps(_mm_max_ps(t1z, t2z), r.t));
+
+	return _mm_and_ps(_mm_cmple_ps(enter, leave), r.active);
+}
+
+static inline void quad_triangle(ray_quad& r, const glm::vec3& v0, const glm::vec3& e1, const glm::vec3& e2, int index)
+{
+	const __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+	const __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(r.dy, e2z), _mm_mul_ps(r.dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(r.dz, e2x), _mm_mul_ps(r.dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(r.dx, e2y), _mm_mul_ps(r.dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+	const __m128 sign = _mm_set1_ps(-0.f);
+	__m128 mask = _mm_and_ps(r.active, _mm_cmpgt_ps(_mm_andnot_ps(sign, det), _mm_set1_ps(ParallelEpsilon)));
+	if (_mm_movemask_ps(mask) == 0) return;
+
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+	__m128 sx = _mm_sub_ps(r.ox, _mm_set1_ps(v0.x));
+	__m128 sy = _mm_sub_ps(r.oy, _mm_set1_ps(v0.y));
+	__m128 sz = _mm_sub_ps(r.oz, _mm_set1_ps(v0.z));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r.dx, qx), _mm_mul_ps(r.dy, qy)), _mm_mul_ps(r.dz, qz)), inv_det);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, r.t)));
+	if (_mm_movemask_ps(mask) == 0) return;
+
+	r.t = select_ps(mask, t, r.t);
+	r.u = select_ps(mask, u, r.u);
+	r.v = select_ps(mask, v, r.v);
+	__m128i imask = _mm_castps_si128(mask);
+	r.id = _mm_or_si128(_mm_and_si128(imask, _mm_set1_epi32(index)), _mm_andnot_si128(imask, r.id));
+}
+#endif
+
+void TriangleBVH::intersect_packet(const glm::vec3* origins, const glm::vec3* directions, int count, float max_t, ray_hit* hits) const
+{
+	count = std::min(count, RayPacketSize);
+
+#if USE_SSE2
+	if (nodes.empty())
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			hits[i] = ray_hit{};
+			hits[i].t = max_t;
+		}
+		return;
+	}
+
+	// two quads make up a packet, lanes past count are switched off
+	const int Quads = RayPacketSize / 4;
+	ray_quad quads[Quads];
+	for (int q = 0; q < Quads; ++q)
+	{
+		alignas(16) float o[3][4], d[3][4], a[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			int i = std::min(q * 4 + k, count - 1);
+			for (int c = 0; c < 3; ++c)
+			{
+				o[c][k] = origins[i][c];
+				d[c][k] = directions[i][c];
+			}
+			a[k] = q * 4 + k < count ? 1.f : 0.f;
+		}
+
+		ray_quad& r = quads[q];
+		r.ox = _mm_load_ps(o[0]);
+		r.oy = _mm_load_ps(o[1]);
+		r.oz = _mm_load_ps(o[2]);
+		r.dx = _mm_load_ps(d[0]);
+		r.dy = _mm_load_ps(d[1]);
+		r.dz = _mm_load_ps(d[2]);
+		r.ix = _mm_div_ps(_mm_set1_ps(1.f), r.dx);
+		r.iy = _mm_div_ps(_mm_set1_ps(1.f), r.dy);
+		r.iz = _mm_div_ps(_mm_set1_ps(1.f), r.dz);
+		r.t = _mm_set1_ps(max_t);
+		r.u = _mm_setzero_ps();
+		r.v = _mm_setzero_ps();
+		r.id = _mm_set1_epi32(-1);
+		r.active = _mm_cmpgt_ps(_mm_load_ps(a), _mm_setzero_ps());
+	}
+
+	const glm::vec3& lead = directions[0];
+
+	int stack[StackSize];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const bvh_node& _node = nodes[stack[--top]];
+
+		// the node is skipped only when it's missed by every ray still in the running
+		int any = 0;
+		for (int q = 0; q < Quads; ++q)
+			any |= _mm_movemask_ps(quad_box(quads[q], _node.mins, _node.maxs));
+		if (any == 0) continue;
+
+		if (_node.count > 0)
+		{
+			for (int i = _node.first; i < _node.first + _node.count; ++i)
+			{
+				const bvh_triangle& tri = triangles[i];
+				for (int q = 0; q < Quads; ++q)
+					quad_triangle(quads[q], tri.v0, tri.e1, tri.e2, i);
+			}
+			continue;
+		}
+
+		// order the children for the packet as a whole, by the first ray's direction
+		const bvh_node& left = nodes[_node.first];
+		const bvh_node& right = nodes[_node.first + 1];
+		float towards = glm::dot((left.mins + left.maxs) - (right.mins + right.maxs), lead);
+		if (towards > 0.f)
+		{
+			stack[top++] = _node.first;
+			stack[top++] = _node.first + 1;
+		}
+		else
+		{
+			stack[top++] = _node.first + 1;
+			stack[top++] = _node.first;
+		}
+	}
+
+	for (int q = 0; q < Quads; ++q)
+	{
+		alignas(16) float t[4], u[4], v[4];
+		alignas(16) int id[4];
+		_mm_store_ps(t, quads[q].t);
+		_mm_store_ps(u, quads[q].u);
+		_mm_store_ps(v, quads[q].v);
+		_mm_store_si128((__m128i*)id, quads[q].id);
+
+		for (int k = 0; k < 4 && q * 4 + k < count; ++k)
+		{
+			ray_hit& hit = hits[q * 4 + k];
+			hit = ray_hit{};
+			hit.t = t[k];
+			hit.triangle = id[k];
+			hit.u = u[k];
+			hit.v = v[k];
+			finish_hit(hit);
+		}
+	}
+#else
+	for (int i = 0; i < count; ++i)
+		hits[i] = intersect(origins[i], directions[i], max_t);
+#endif
+}
+
+ray_benchmark TriangleBVH::benchmark(int packets) const
+{
+	ray_benchmark result;
+	if (nodes.empty() || packets <= 0) return result;
+
+	// each packet starts somewhere in the map and fans out a few degrees around a random
+	// direction, about what a shotgun blast or a tile of screen pixels would do
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	std::normal_distribution<float> normal(0.f, 1.f);
+
+	const glm::vec3& mins = nodes[0].mins;
+	const glm::vec3& maxs = nodes[0].maxs;
+	float max_t = glm::length(maxs - mins);
+
+	int count = packets * RayPacketSize;
+	std::vector<glm::vec3> origins(count), directions(count);
+
+	for (int p = 0; p < packets; ++p)
+	{
+		glm::vec3 origin = mins + (maxs - mins) * glm::vec3(unit(rng), unit(rng), unit(rng));
+		glm::vec3 centre = glm::normalize(glm::vec3(normal(rng), normal(rng), normal(rng)));
+
+		for (int k = 0; k < RayPacketSize; ++k)
+		{
+			glm::vec3 spread(normal(rng), normal(rng), normal(rng));
+			origins[p * RayPacketSize + k] = origin;
+			directions[p * RayPacketSize + k] = glm::normalize(centre + spread * 0.05f);
+		}
+	}
+
+	std::vector<ray_hit> single(count), packet(count);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; ++i)
+		single[i] = intersect(origins[i], directions[i], max_t);
+	std::chrono::duration<double> single_time = std::chrono::high_resolution_clock::now() - start;
+
+	start = std::chrono::high_resolution_clock::now();
+	for (int p = 0; p < packets; ++p)
+		intersect_packet(&origins[p * RayPacketSize], &directions[p * RayPacketSize], RayPacketSize, max_t, &packet[p * RayPacketSize]);
+	std::chrono::duration<double> packet_time = std::chrono::high_resolution_clock::now() - start;
+
+	result.rays = count;
+	result.single_rate = single_time.count() > 0 ? count / single_time.count() : 0;
+	result.packet_rate = packet_time.count() > 0 ? count / packet_time.count() : 0;
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (single[i].hit()) result.hits++;
+		if (single[i].triangle != packet[i].triangle || single[i].instance != packet[i].instance) result.mismatches++;
+	}
+
+	return result;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "BSPLoader.h"
+
+// rays traced together by intersect_packet
+const int RayPacketSize = 8;
+
+struct ray_hit
+{
+	float t;			// distance along the ray, in units of its direction
+	int triangle{ -1 };	// first index of the triangle in the loader's index buffer, divided by 3,
+						// or in the model index buffer for a misc_model
+	int face{ -1 };
+	int instance{ -1 };	// the misc_model hit, face is -1 when this is set
+	float u{ 0.f };		// barycentric weights of the triangle's second and third vertices
+	float v{ 0.f };
+	int shader{ -1 };	// the face's texture/shader index
+
+	bool hit() const { return triangle >= 0; }
+};
+
+// single rays against packets, rates are rays per second
+struct ray_benchmark
+{
+	int rays{ 0 };
+	int hits{ 0 };
+	double single_rate{ 0 };
+	double packet_rate{ 0 };
+	int mismatches{ 0 };	// rays where the two paths hit different triangles
+};
+
+// bounding volume hierarchy over the triangles a map draws: brush faces, tessellated patches
+// and every placed misc_model, for exact ray hits that the brushes can't give.
+class TriangleBVH
+{
+public:
+	// binned surface area heuristic build over the loader's current triangles
+	void build(const BSPLoader& loader);
+	void clear();
+
+	// closest hit along origin + t * direction for t in (0, max_t)
+	ray_hit intersect(const glm::vec3& origin, const glm::vec3& direction, float max_t) const;
+
+	// up to RayPacketSize rays at once, sharing the walk down the tree. fastest when the
+	// rays head the same way, like a spread of pellets or a block of pixels.
+	void intersect_packet(const glm::vec3* origins, const glm::vec3* directions, int count, float max_t, ray_hit* hits) const;
+
+	// runs coherent packets of random rays through both paths and compares them
+	ray_benchmark benchmark(int packets) const;
+
+	int triangle_count() const { return (int)triangles.size(); }
+	int node_count() const { return (int)nodes.size(); }
+
+private:
+	struct bvh_node
+	{
+		glm::vec3 mins;
+		int first;		// first triangle for a leaf, the left child (right is first + 1) otherwise
+		glm::vec3 maxs;
+		int count;		// triangles in a leaf, 0 for an interior node
+	};
+
+	struct bvh_triangle
+	{
+		glm::vec3 v0;
+		glm::vec3 e1;	// v1 - v0
+		glm::vec3 e2;	// v2 - v0
+		int id;			// triangle index in the loader
+		int face;		// or -1 - the instance for a misc_model
+		int shader;
+	};
+
+	struct build_triangle
+	{
+		glm::vec3 mins;
+		glm::vec3 maxs;
+		glm::vec3 centre;
+	};
+
+	void build_node(int node, int first, int count, std::vector<build_triangle>& bounds, std::vector<int>& order, int depth);
+	void finish_hit(ray_hit& hit) const;
+
+	std::vector<bvh_node> nodes;
+	std::vector<bvh_triangle> triangles;
+};